@@ -7,28 +7,169 @@
 #define DEFAULT_DT 0.02
 #define DEFAULT_POSITION_MODE 2
 #define DEFAULT_MATRIX_MODE 1
+#define DEFAULT_MATRIX_FORMAT 0
+#define DEFAULT_FAMILIES 4
+#define DEFAULT_RANK 2
 #define DEFAULT_COLOR_MODE 1
 #define DEFAULT_DENSITY_CHARS ".:oO80@"
 #define DEFAULT_STEPS_PER_FRAME 10
 
 #define MAX_WAIT_ARG_LEN 10
 #define NUM_POSITION_MODES 4
-#define NUM_MATRIX_MODES 2
+#define NUM_MATRIX_MODES 4
+#define NUM_MATRIX_FORMATS 4  // not counting "0" mode
 #define NUM_COLOR_MODES 1  // not counting "0" mode
 
 #define CHAR_RATIO 2.0f
 
+// storage formats of the attraction matrix
+#define MATRIX_FORMAT_AUTO 0
+#define MATRIX_FORMAT_DENSE 1
+#define MATRIX_FORMAT_BLOCK 2
+#define MATRIX_FORMAT_LOW_RANK 3
+#define MATRIX_FORMAT_QUANTIZED 4
+
+#define LOW_RANK_ITERATIONS 30
+
+// long options without a short equivalent
+#define OPT_FORCE_EXPR 256
+#define OPT_PROCS 257
+#define OPT_THREADS 258
+#define OPT_PIN 259
+#define OPT_HUGEPAGES 260
+#define OPT_AUTOTUNE 261
+#define OPT_CELL_DIVISOR 262
+#define OPT_REORDER 263
+#define OPT_GHOST_CELLS 264
+#define OPT_ACCURACY 265
+#define OPT_LOAD 266
+#define OPT_SAVE 267
+#define OPT_NO_CACHE 268
+#define OPT_RECORD 269
+#define OPT_RECORD_EVERY 270
+#define OPT_RECORD_VELOCITIES 271
+#define OPT_READ_RECORD 272
+#define OPT_SETTINGS 273
+#define OPT_SAVE_SETTINGS 274
+#define OPT_WATCH_SETTINGS 275
+#define OPT_CHECKPOINT_EVERY 276
+#define OPT_REWIND 277
+#define OPT_REWIND_EVERY 278
+#define OPT_REPLAY 279
+#define OPT_RAW_FRAMES 280
+#define OPT_EXPORT_IMAGES 281
+#define OPT_IMAGE_SIZE 282
+#define OPT_IMAGE_FORMAT 283
+#define OPT_EXPORT_FRAMES 284
+#define OPT_DIRECT 285
+#define OPT_SIM_THREAD 286
+
+// engine settings and autotuning
+#define MAX_CELL_DIVISOR 3
+#define AUTOTUNE_WINDOW 20          // timed steps per trial
+#define AUTOTUNE_INTERVAL 2000      // steps between tuning rounds
+#define AUTOTUNE_MAX_CANDIDATES 8
+
+// accuracy tiers of the force computation
+#define ACCURACY_EXACT 0
+#define ACCURACY_FAST 1
+
+// binary snapshots, see saveSnapshot()
+#define SNAPSHOT_MAGIC "PLSNAP\0\0"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_BYTE_ORDER 0x01020304
+#define SNAPSHOT_ALIGNMENT 64
+#define DEFAULT_SAVE_FILE "particle-life.snap"
+#define CHECKPOINT_FILES 3          // checkpoints rotate through this many files
+
+// in-memory history for rewinding, see rewindSteps()
+#define DEFAULT_REWIND_EVERY 50
+#define REWIND_KEYFRAME_INTERVAL 8  // entries per independently decodable group
+
+// settings files, see loadSettings()
+#define SETTING_INT 0
+#define SETTING_FLOAT 1
+#define SETTING_BOOL 2
+#define SETTING_STRING 3
+#define SETTINGS_INLINE_MATRIX 32   // larger matrices are saved to a binary matrix file
+#define MATRIX_MAGIC "PLMATRIX"
+
+// -O redraws unchanged cells between changed ones instead of moving the cursor over gaps up to this size
+#define TEXT_MAX_REDRAWN_GAP 4
+
+// attributes of --direct screen cells, above the color of textCell()
+#define SCREEN_REVERSE (1u << 24)
+#define SCREEN_LINE_DRAWING (1u << 25)
+
+// binary density frames on stdout, see writeRawFrame()
+#define RAW_FRAME_MAGIC "PLDF"
+
+// image sequences, see exportImage()
+#define DEFAULT_IMAGE_SIZE "1280x720"
+#define IMAGE_FORMAT_PPM 0
+#define IMAGE_FORMAT_PNG 1
+#define IMAGE_QUEUE_LENGTH 4        // rendered images waiting for the writer thread
+#define IMAGE_HASH_BITS 15          // of the PNG match finder
+#define IMAGE_HASH_SIZE (1 << IMAGE_HASH_BITS)
+
+// binary trajectories, see writeRecordFrame()
+#define RECORD_MAGIC "PLTRAJ\0\0"
+#define RECORD_VERSION 1
+#define RECORD_VELOCITIES 1         // header and frame flag
+#define RECORD_KEYFRAME 2           // frame flag: values are not deltas
+#define RECORD_PREDICTED 4          // frame flag: deltas to the linear extrapolation of two frames
+#define RECORD_BLOCK_SIZE 4096      // particles per independently decodable block
+#define RECORD_QUEUE_LENGTH 4       // captured frames waiting for the writer thread
+#define RECORD_KEYFRAME_INTERVAL 256
+
+// particles per random stream, independent of the number of threads
+#define RNG_BLOCK_SIZE 4096
+
+// huge page backing of the arena
+#define HUGE_PAGES_OFF 0
+#define HUGE_PAGES_TRANSPARENT 1
+#define HUGE_PAGES_EXPLICIT 2
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+#define ARENA_ALIGNMENT 64
+#define ARENA_MIN_BLOCK_SIZE (1024 * 1024)
+
+#define PLACEMENT_SAMPLE_PAGES 256
+
+#define _GNU_SOURCE  // CPU affinity
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
 #include <time.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <float.h>
+#include <limits.h>
+#include <signal.h>
+#include <errno.h>
+#ifdef __SSE__
+    #include <xmmintrin.h>
+#endif
 
 #ifdef _WIN32
     #include "curses.h"
     #include "getopt.h"
 #elif __unix__
     #include <curses.h>
+    #include <getopt.h>
+    #include <dlfcn.h>
+    #include <pthread.h>
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <sys/wait.h>
+    #include <sys/uio.h>
+    #include <sched.h>
+    #include <stdatomic.h>
+#endif
+#ifdef __linux__
+    #include <sys/prctl.h>
+    #include <sys/syscall.h>
 #endif
 
 #include <unistd.h>
@@ -49,6 +190,18 @@ void print_help() {
     printf("  -a <mode>           attraction mode (default: %d)\n", DEFAULT_MATRIX_MODE);
     printf("                          1: random\n");
     printf("                          2: snakes\n");
+    printf("                          3: families (block structured)\n");
+    printf("                          4: low rank\n");
+    printf("  -A <matrix>         attraction matrix, a text or binary matrix file or the values\n");
+    printf("                      row by row (\"1,0.5,-0.2,1\"), sets the number of colors\n");
+    printf("  -F <format>         attraction matrix storage format (default: %d)\n", DEFAULT_MATRIX_FORMAT);
+    printf("                          0: automatic (depends on attraction mode)\n");
+    printf("                          1: dense\n");
+    printf("                          2: block (one value per pair of families)\n");
+    printf("                          3: low rank\n");
+    printf("                          4: 8-bit quantized\n");
+    printf("  -f <families>       number of families for block matrices (default: %d)\n", DEFAULT_FAMILIES);
+    printf("  -R <rank>           rank of low rank matrices (default: %d)\n", DEFAULT_RANK);
     printf("  -r <distance>       maximum interaction radius (default: %.2f)\n", DEFAULT_RADIUS);
     printf("  -t <seconds>        delta time in seconds (default: %.2f)\n", DEFAULT_DT);
     printf("  -p <mode>           position mode (default: %d)\n", DEFAULT_POSITION_MODE);
@@ -65,12 +218,66 @@ void print_help() {
     printf("  -d                  disables clearing of the render buffer\n");
     printf("  -o                  output to stdout (disables GUI)\n");
     printf("  -O                  like -o, but draws the frames in-place\n");
+    printf("  --raw-frames        like -o, but writes binary frames: a header (\"%s\", 32 bit width, height\n", RAW_FRAME_MAGIC);
+    printf("                      and colors, 64 bit frame number) and the 16 bit particle count of each\n");
+    printf("                      cell and color (saturating at 65535), all little-endian\n");
+    printf("  --export-images <dir> instead of showing the frames, save them as images into <dir>\n");
+    printf("  --image-size <w>x<h> size of the exported images in pixels (default: %s)\n", DEFAULT_IMAGE_SIZE);
+    printf("  --image-format <format> format of the exported images (default: %d)\n", IMAGE_FORMAT_PNG);
+    printf("                          0: PPM\n");
+    printf("                          1: PNG\n");
+    printf("  --export-frames <n> quit after exporting n images (default: 0 = never)\n");
+    printf("  --direct            draw the GUI by writing only the changed characters straight to the\n");
+    printf("                      terminal instead of through curses (faster on large terminals)\n");
+    printf("  --sim-thread        run the simulation on its own thread, the GUI shows its latest state\n");
     printf("  -q                  quit after the first rendered frame\n");
     printf("  -W <width>          set the height of the text output\n");
     printf("  -H <height>         set the width of the text output\n");
     printf("  -P                  launch paused\n");
     printf("  -k <int>            steps per frame (default: %d)\n", DEFAULT_STEPS_PER_FRAME);
     printf("  -K <int>            frames to render silently before start (default: 0)\n");
+    printf("  --force-expr <expr> custom force law as a C expression of r (distance / rmax) and a (attraction),\n");
+    printf("                      compiled into a native kernel (unix only, needs a C compiler),\n");
+    printf("                      which reads the dense matrix at exact distances: not with -F 2, 3 or 4,\n");
+    printf("                      --accuracy 1 or --ghost-cells\n");
+    printf("  --procs <n>         split the domain into n horizontal slabs simulated by\n");
+    printf("                      separate worker processes (unix only, default: 1)\n");
+    printf("  --threads <n>       number of simulation threads (unix only, default: 1)\n");
+    printf("  --pin               pin threads and worker processes to separate cores (linux only)\n");
+    printf("  --hugepages <mode>  huge page backing of all buffers (unix only, default: 0)\n");
+    printf("                          0: off\n");
+    printf("                          1: transparent huge pages\n");
+    printf("                          2: explicit huge pages (falls back to 1)\n");
+    printf("  --cell-divisor <d>  cells of size rmax/d, searched d cells in each direction\n");
+    printf("                      (1 to %d, default: 1)\n", MAX_CELL_DIVISOR);
+    printf("  --reorder <steps>   sort particles by cell every <steps> steps (default: 0 = never)\n");
+    printf("  --ghost-cells       search neighbours in a grid padded with shifted copies of the\n");
+    printf("                      opposite boundary instead of wrapping around\n");
+    printf("  --accuracy <tier>   accuracy of the force computation (default: %d)\n", ACCURACY_EXACT);
+    printf("                          0: exact\n");
+    printf("                          1: fast (approximate reciprocal square root)\n");
+    printf("  --load <file>       start from a particle file or a binary snapshot\n");
+    printf("  --save <file>       save to <file> on quit and with [S] (default for [S]: %s),\n", DEFAULT_SAVE_FILE);
+    printf("                      a binary snapshot if the name ends with .snap, else a particle file\n");
+    printf("  --checkpoint-every <steps> save a snapshot every <steps> steps from a forked process,\n");
+    printf("                      rotating through %d files named after the --save file\n", CHECKPOINT_FILES);
+    printf("  --rewind <MB>       keep a history of up to <MB> megabytes for rewinding with [b] and [B]\n");
+    printf("                      (default: 0 = off)\n");
+    printf("  --rewind-every <steps> steps between rewind entries (default: %d)\n", DEFAULT_REWIND_EVERY);
+    printf("  --no-cache          always simulate the -K frames, instead of reusing the state\n");
+    printf("                      cached by an earlier run with the same seed and settings\n");
+    printf("  --record <file>     stream the particle positions into a compressed binary file\n");
+    printf("  --record-every <k>  record every k-th step (default: 1)\n");
+    printf("  --record-velocities also record the velocities\n");
+    printf("  --read-record <file> print a recorded file as text (one particle per line) and exit\n");
+    printf("  --replay <file>     play a recording instead of simulating, -k sets the speed,\n");
+    printf("                      [b]/[B] and [f]/[F] go back and forward by one/ten frames\n");
+    printf("  --settings <file>   load options from a settings file (\"name value\" per line),\n");
+    printf("                      later options override earlier ones\n");
+    printf("  --save-settings <file> save the settings and the matrix to <file> on quit and with [S]\n");
+    printf("  --watch-settings    apply changes of the --settings file while running\n");
+    printf("  --autotune          periodically time alternative thread counts, cell divisors\n");
+    printf("                      and reorder intervals and switch to the fastest\n");
     printf("  -h                  print this help message\n");
 }
 
@@ -83,23 +290,160 @@ typedef struct {
     float vy;
 } Particle;
 
+// signature of runtime-compiled force kernels, see compileForceKernel()
+typedef void (*ForceKernel)(Particle *particles, int count, int cellStart, int cellStop,
+        int gridSize, int reach, int *grid, int *gridMap,
+        int m, float *matrix, float rMax, float forceFactor, float frictionFactor, float dt);
+
+// memory blocks of an Arena, newest first
+typedef struct ArenaBlock {
+    char *base;
+    size_t size;
+    size_t used;
+    struct ArenaBlock *next;
+} ArenaBlock;
+
+// released buffer, reused by arenaAlloc()
+typedef struct ArenaChunk {
+    size_t size;
+    struct ArenaChunk *next;
+} ArenaChunk;
+
+// owns all simulation and render buffers, see arenaAlloc()
+typedef struct {
+    int hugePages;            // HUGE_PAGES_*
+    ArenaBlock *blocks;       // private to this process
+    ArenaBlock *sharedBlocks; // shared with forked worker processes
+    ArenaChunk *freeChunks;   // released private buffers, see arenaRelease()
+    ArenaBlock *adopted;      // mapped files, unmapped when their buffer is released
+} Arena;
+
+// jobs run by every thread of a ThreadPool, see runJob()
+typedef void (*ThreadJob)(void *arg, int thread, int numThreads);
+
+#ifdef __unix__
+typedef struct {
+    int numThreads;
+    int activeThreads;  // threads taking part in jobs, <= numThreads
+    bool pin;
+    pthread_t *handles;
+    pthread_barrier_t barrier;
+    ThreadJob job;  // NULL to quit
+    void *arg;
+} ThreadPool;
+
+typedef struct {
+    ThreadPool *pool;
+    int thread;
+} ThreadStart;
+#else
+typedef struct {
+    int numThreads;
+    int activeThreads;
+    bool pin;
+} ThreadPool;
+#endif
+
+// xoshiro256** random number generator, see rngSeed()
+typedef struct {
+    uint64_t s[4];
+} Rng;
+
+// header of a binary snapshot. the arrays follow at SNAPSHOT_ALIGNMENT aligned
+// offsets, so that a mapped file can be used in place.
+typedef struct {
+    char magic[8];              // SNAPSHOT_MAGIC
+    uint32_t version;           // SNAPSHOT_VERSION
+    uint32_t byteOrder;         // SNAPSHOT_BYTE_ORDER as written by this machine
+    uint32_t particleSize;      // sizeof(Particle)
+    int32_t n;
+    int32_t m;
+    int32_t numFamilies;
+    int32_t rank;
+    int32_t matrixFormat;
+    int32_t activeMatrixFormat;
+    int32_t stepsSinceReorder;
+    float rMax;
+    float frictionHalfLife;
+    float forceFactor;
+    float dt;
+    float quantScale;
+    uint64_t rng[4];
+    uint64_t particlesOffset;   // n particles
+    uint64_t matrixOffset;      // m x m floats
+    uint64_t familyOffset;      // m ints
+    uint64_t blockMatrixOffset; // numFamilies x numFamilies floats
+    uint64_t factorUOffset;     // m x rank floats
+    uint64_t factorVOffset;     // m x rank floats
+    uint64_t quantMatrixOffset; // m x m signed chars
+    uint64_t fileSize;
+} SnapshotHeader;
+
 typedef struct {
     float rMax;
     float frictionHalfLife;
     float forceFactor;
     float dt;
     int n;
+    int capacity;               // particles allocated, >= n
     Particle *particles;
     int gridSize;
+    int gridCapacity;           // number of ints allocated for grid
+    int cellDivisor;            // cells of size rMax / cellDivisor
     int *grid;
     int *gridMap;
+    int *cellTypes;             // particles per cell and type, gridSize * gridSize * m, see buildGrid()
+    int cellTypesCapacity;      // number of ints allocated for cellTypes
+    bool cellTypesWanted;       // buildGrid() fills cellTypes, set by renderDensity() when zoomed out
+    bool cellTypesCurrent;      // cellTypes were filled by the last buildGrid()
+    bool gridCurrent;           // the cells hold the particles as of their last move, see renderDensity()
+    float maxMove;              // farthest a particle moved along x or y in the last move
+    int reorderInterval;        // steps between sorting particles by cell, 0 = never
+    int stepsSinceReorder;
+    Particle *spareParticles;   // target buffer for reordering
+    int accuracy;               // ACCURACY_*
+    bool ghostCells;            // neighbour search in a padded grid, see buildGhostCells()
+    int ghostGridCapacity;      // number of ints allocated for ghostGrid
+    int *ghostGrid;             // cell starts of the grid padded by cellDivisor cells
+    Particle *ghostParticles;   // particle copies in padded cell order, 4 * capacity
     int m;
-    float *matrix;
+    int typeCapacity;           // types allocated for the matrix buffers, >= m
+    float *matrix;              // dense m x m matrix as generated or given, lossy formats only approximate it
+    int matrixFormat;           // requested format (MATRIX_FORMAT_*)
+    int activeMatrixFormat;     // format actually used by update()
+    int numFamilies;            // block format: families of types
+    int *family;                // block format: family of each type
+    float *blockMatrix;         // block format: numFamilies x numFamilies, numFamilies <= m
+    int rank;                   // low rank format: matrix = U * V^T
+    float *factorU;             // low rank format: m x rank
+    float *factorV;             // low rank format: m x rank
+    signed char *quantMatrix;   // quantized format: m x m
+    float quantScale;           // quantized format: value of one step
+    ForceKernel forceKernel;    // replaces the built-in velocity loop if set
+    ThreadPool *threads;        // parallelizes update() if set
+    Arena *arena;               // owns all buffers
+    Rng rng;                    // seeds the parallel streams of initialization
+    int layoutVersion;          // changes whenever particle indices or types are reassigned
 } ParticleSystem;
 
+// buffers and statistics of renderText()
+typedef struct {
+    char *full;                 // the frame drawn from scratch
+    char *diff;                 // only the cells that changed, for -O
+    uint32_t *cells;            // character and color of each cell, see textCell()
+    uint32_t *previous;         // cells on the screen
+    int w;                      // the buffers are allocated for w * h cells
+    int h;
+    uint64_t frames;
+    uint64_t bytes;
+    uint64_t fullBytes;         // what drawing every frame from scratch would have taken
+} TextOutput;
+
 typedef struct {
+    bool rawFrames;
     bool printInPlace;
     bool printInPlaceIsFirstFrame;
+    TextOutput text;
     int w;
     int h;
     float zoom;
@@ -114,9 +458,364 @@ typedef struct {
 } UiSettings;
 
 
-float randFloat() {
-    return (float) rand() / (float) RAND_MAX;
+uint64_t splitMix64(uint64_t *x) {
+    uint64_t z = (*x += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+void rngSeed(Rng *rng, uint64_t seed, uint64_t stream) {
+    // independent generators for each (seed, stream) pair,
+    // identical on all platforms
+    uint64_t x = seed;
+    uint64_t mixedSeed = splitMix64(&x);
+    x = mixedSeed ^ (stream * 0xD1B54A32D192ED03ULL);
+    for (int i = 0; i < 4; i++) {
+        rng->s[i] = splitMix64(&x);
+    }
+}
+
+uint64_t rngNext(Rng *rng) {
+    uint64_t *s = rng->s;
+    uint64_t x = s[1] * 5;
+    uint64_t result = ((x << 7) | (x >> 57)) * 9;
+    uint64_t t = s[1] << 17;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = (s[3] << 45) | (s[3] >> 19);
+    return result;
+}
+
+float rngFloat(Rng *rng) {
+    // uniform in [0, 1)
+    return (float) (rngNext(rng) >> 40) * (1.0f / 16777216.0f);
+}
+
+int rngBelow(Rng *rng, int bound) {
+    // uniform in [0, bound)
+    return (int) (((rngNext(rng) >> 32) * (uint64_t) bound) >> 32);
+}
+
+
+bool pinCurrentThread(int index) {
+    // pins the calling thread to the index-th CPU the process may run on
+#ifdef __linux__
+    // remember the initial affinity, pinning the main thread changes it
+    static int cpus[CPU_SETSIZE];
+    static int numCpus = -1;
+    if (numCpus < 0) {
+        cpu_set_t allowed;
+        numCpus = 0;
+        if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+            for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+                if (CPU_ISSET(cpu, &allowed)) cpus[numCpus++] = cpu;
+            }
+        }
+    }
+    if (numCpus == 0) return false;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpus[index % numCpus], &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+    return false;
+#endif
+}
+
+int currentNode(int *cpu) {
+    // NUMA node (and CPU) the calling thread is running on, -1 if unknown
+#ifdef __linux__
+    unsigned int c = 0;
+    unsigned int node = 0;
+    if (syscall(SYS_getcpu, &c, &node, NULL) != 0) return -1;
+    if (cpu != NULL) *cpu = (int) c;
+    return (int) node;
+#else
+    if (cpu != NULL) *cpu = -1;
+    return -1;
+#endif
+}
+
+int countPagesOnNode(void *ptr, size_t bytes, int node, int *sampled) {
+    // samples up to PLACEMENT_SAMPLE_PAGES pages of [ptr, ptr + bytes)
+    // and counts how many of them reside on the given NUMA node
+    *sampled = 0;
+#ifdef __linux__
+    long pageSize = sysconf(_SC_PAGESIZE);
+    size_t numPages = (bytes + pageSize - 1) / pageSize;
+    if (numPages == 0) return 0;
+    size_t stride = numPages / PLACEMENT_SAMPLE_PAGES + 1;
+    void *pages[PLACEMENT_SAMPLE_PAGES + 1];
+    int status[PLACEMENT_SAMPLE_PAGES + 1];
+    int count = 0;
+    for (size_t i = 0; i < numPages && count <= PLACEMENT_SAMPLE_PAGES; i += stride) {
+        pages[count++] = (char *) ptr + i * pageSize;
+    }
+    if (syscall(SYS_move_pages, 0, count, pages, NULL, status, 0) != 0) return 0;
+    int local = 0;
+    for (int i = 0; i < count; i++) {
+        if (status[i] >= 0) (*sampled)++;
+        if (status[i] == node) local++;
+    }
+    return local;
+#else
+    return 0;
+#endif
+}
+
+void moveToLocalNode(void *ptr, size_t bytes) {
+    // migrates already allocated pages to the NUMA node of the calling thread
+#ifdef __linux__
+    int node = currentNode(NULL);
+    if (node < 0) return;
+    long pageSize = sysconf(_SC_PAGESIZE);
+    char *start = (char *) ((size_t) ptr / pageSize * pageSize);
+    size_t numPages = ((char *) ptr + bytes - start + pageSize - 1) / pageSize;
+    void *pages[1024];
+    int nodes[1024];
+    int status[1024];
+    for (size_t i = 0; i < numPages; i += 1024) {
+        int count = (numPages - i < 1024) ? (int) (numPages - i) : 1024;
+        for (int j = 0; j < count; j++) {
+            pages[j] = start + (i + j) * pageSize;
+            nodes[j] = node;
+        }
+        syscall(SYS_move_pages, 0, count, pages, nodes, status, 2 /* MPOL_MF_MOVE */);
+    }
+#endif
+}
+
+void *mapPages(size_t size, int *hugePages, bool shared) {
+    // fresh zeroed pages, placed on the NUMA node of the first thread touching them
+#ifdef __unix__
+    int flags = (shared ? MAP_SHARED : MAP_PRIVATE) | MAP_ANONYMOUS | MAP_NORESERVE;
+#ifdef MAP_HUGETLB
+    if (*hugePages == HUGE_PAGES_EXPLICIT) {
+        // without MAP_NORESERVE, so that a lack of huge pages fails here and not on first touch
+        void *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, (flags & ~MAP_NORESERVE) | MAP_HUGETLB, -1, 0);
+        if (ptr != MAP_FAILED) return ptr;
+        fprintf(stderr, "no explicit huge pages available, using transparent huge pages\n");
+        *hugePages = HUGE_PAGES_TRANSPARENT;
+    }
+#endif
+    void *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+    if (ptr == MAP_FAILED) return NULL;
+#ifdef MADV_HUGEPAGE
+    if (*hugePages != HUGE_PAGES_OFF) madvise(ptr, size, MADV_HUGEPAGE);
+#endif
+    return ptr;
+#else
+    return calloc(1, size);
+#endif
+}
+
+void unmapPages(void *ptr, size_t size) {
+#ifdef __unix__
+    munmap(ptr, size);
+#else
+    free(ptr);
+#endif
+}
+
+void arenaInit(Arena *arena, int hugePages) {
+    arena->hugePages = hugePages;
+    arena->blocks = NULL;
+    arena->sharedBlocks = NULL;
+    arena->freeChunks = NULL;
+    arena->adopted = NULL;
+}
+
+void arenaRelease(Arena *arena, void *ptr, size_t size) {
+    // hands a private buffer of the given size back for reuse by arenaAlloc(),
+    // a buffer in an adopted file is not reused, the whole file is unmapped
+    for (ArenaBlock **link = &arena->adopted; *link != NULL; link = &(*link)->next) {
+        ArenaBlock *block = *link;
+        if ((char *) ptr >= block->base && (char *) ptr < block->base + block->size) {
+            *link = block->next;
+            unmapPages(block->base, block->size);
+            free(block);
+            return;
+        }
+    }
+    size = (size + ARENA_ALIGNMENT - 1) / ARENA_ALIGNMENT * ARENA_ALIGNMENT;
+    if (ptr == NULL || size == 0) return;
+    ArenaChunk *chunk = (ArenaChunk *) ptr;
+    chunk->size = size;
+    chunk->next = arena->freeChunks;
+    arena->freeChunks = chunk;
+}
+
+void *arenaAlloc(Arena *arena, size_t size, bool shared) {
+    // 64-byte aligned, zeroed memory that lives until arenaRelease() or arenaFree().
+    // call outside of update(), a new block may have to be mapped.
+    ArenaBlock **blocks = shared ? &arena->sharedBlocks : &arena->blocks;
+    size = (size + ARENA_ALIGNMENT - 1) / ARENA_ALIGNMENT * ARENA_ALIGNMENT;
+    if (!shared) {
+        // first fit from the released buffers, the rest stays available
+        for (ArenaChunk **link = &arena->freeChunks; *link != NULL; link = &(*link)->next) {
+            ArenaChunk *chunk = *link;
+            if (chunk->size < size) continue;
+            *link = chunk->next;
+            arenaRelease(arena, (char *) chunk + size, chunk->size - size);
+            memset(chunk, 0, size);
+            return chunk;
+        }
+    }
+    ArenaBlock *block = *blocks;
+    if (block == NULL || block->size - block->used < size) {
+        size_t blockSize = size < ARENA_MIN_BLOCK_SIZE ? ARENA_MIN_BLOCK_SIZE : size;
+        if (arena->hugePages != HUGE_PAGES_OFF) {
+            blockSize = (blockSize + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+        }
+        char *base = mapPages(blockSize, &arena->hugePages, shared);
+        if (base == NULL) {
+            fprintf(stderr, "out of memory (%zu bytes)\n", blockSize);
+            exit(EXIT_FAILURE);
+        }
+        block = malloc(sizeof(ArenaBlock));
+        block->base = base;
+        block->size = blockSize;
+        block->used = 0;
+        block->next = *blocks;
+        *blocks = block;
+    }
+    void *ptr = block->base + block->used;
+    block->used += size;
+    return ptr;
+}
+
+void arenaAdopt(Arena *arena, void *base, size_t size) {
+    // takes ownership of mapped pages, e.g. a file, until a buffer in them is released or arenaFree()
+    ArenaBlock *block = malloc(sizeof(ArenaBlock));
+    block->base = base;
+    block->size = size;
+    block->used = size;
+    block->next = arena->adopted;
+    arena->adopted = block;
+}
+
+size_t arenaFootprint(Arena *arena) {
+    // bytes mapped for all buffers
+    size_t total = 0;
+    for (ArenaBlock *block = arena->blocks; block != NULL; block = block->next) {
+        total += block->size;
+    }
+    for (ArenaBlock *block = arena->sharedBlocks; block != NULL; block = block->next) {
+        total += block->size;
+    }
+    for (ArenaBlock *block = arena->adopted; block != NULL; block = block->next) {
+        total += block->size;
+    }
+    return total;
+}
+
+void arenaFree(Arena *arena) {
+    ArenaBlock *lists[3] = {arena->blocks, arena->sharedBlocks, arena->adopted};
+    for (int i = 0; i < 3; i++) {
+        ArenaBlock *block = lists[i];
+        while (block != NULL) {
+            ArenaBlock *next = block->next;
+            unmapPages(block->base, block->size);
+            free(block);
+            block = next;
+        }
+    }
+    arena->blocks = NULL;
+    arena->sharedBlocks = NULL;
+    arena->freeChunks = NULL;
+    arena->adopted = NULL;
+}
+
+
+#ifdef __unix__
+void *threadMain(void *arg) {
+    ThreadStart *start = (ThreadStart *) arg;
+    ThreadPool *pool = start->pool;
+    int thread = start->thread;
+    free(start);
+
+    if (pool->pin) pinCurrentThread(thread);
+    while (true) {
+        pthread_barrier_wait(&pool->barrier);
+        if (pool->job == NULL) break;
+        if (thread < pool->activeThreads) {
+            pool->job(pool->arg, thread, pool->activeThreads);
+        }
+        pthread_barrier_wait(&pool->barrier);
+    }
+    return NULL;
+}
+
+ThreadPool *startThreads(int numThreads, bool pin) {
+    // the calling thread takes part as thread 0
+    ThreadPool *pool = malloc(sizeof(ThreadPool));
+    pool->numThreads = numThreads;
+    pool->activeThreads = numThreads;
+    pool->pin = pin;
+    pool->handles = malloc(numThreads * sizeof(pthread_t));
+    pool->job = NULL;
+    pool->arg = NULL;
+    pthread_barrier_init(&pool->barrier, NULL, numThreads);
+
+    if (pin) pinCurrentThread(0);
+    for (int i = 1; i < numThreads; i++) {
+        ThreadStart *start = malloc(sizeof(ThreadStart));
+        start->pool = pool;
+        start->thread = i;
+        pthread_create(&pool->handles[i], NULL, threadMain, start);
+    }
+    return pool;
+}
+
+void runJob(ThreadPool *pool, ThreadJob job, void *arg) {
+    // runs job on all active threads and waits until all of them are done
+    if (pool->activeThreads == 1) {
+        job(arg, 0, 1);
+        return;
+    }
+    pool->job = job;
+    pool->arg = arg;
+    pthread_barrier_wait(&pool->barrier);
+    job(arg, 0, pool->activeThreads);
+    pthread_barrier_wait(&pool->barrier);
+}
+
+void stopThreads(ThreadPool *pool) {
+    if (pool->numThreads > 1) {
+        pool->job = NULL;
+        pthread_barrier_wait(&pool->barrier);
+        for (int i = 1; i < pool->numThreads; i++) {
+            pthread_join(pool->handles[i], NULL);
+        }
+    }
+    pthread_barrier_destroy(&pool->barrier);
+    free(pool->handles);
+    free(pool);
+}
+#else
+ThreadPool *startThreads(int numThreads, bool pin) {
+    if (numThreads > 1 || pin) {
+        fprintf(stderr, "threads are not supported on this platform\n");
+    }
+    ThreadPool *pool = malloc(sizeof(ThreadPool));
+    pool->numThreads = 1;
+    pool->activeThreads = 1;
+    pool->pin = false;
+    return pool;
+}
+
+void runJob(ThreadPool *pool, ThreadJob job, void *arg) {
+    job(arg, 0, 1);
+}
+
+void stopThreads(ThreadPool *pool) {
+    free(pool);
 }
+#endif
 
 
 float force(float r, float a) {
@@ -131,6 +830,30 @@ float force(float r, float a) {
 }
 
 
+float fastForce(float r, float a) {
+    // force() with its divisions folded into constants
+    const float beta = 0.3;
+    const float invBeta = 1.0f / beta;
+    const float invOneMinusBeta = 1.0f / (1.0f - beta);
+    if (r < beta) {
+        return r * invBeta - 1;
+    } else if (beta < r && r < 1.0f) {
+        return a * (1 - fabsf(2 * r - 1 - beta) * invOneMinusBeta);
+    } else {
+        return 0;
+    }
+}
+float fastRsqrt(float x) {
+    // 1 / sqrt(x), a 12 bit estimate refined by one Newton step (relative error < 1e-6)
+#ifdef __SSE__
+    float y = _mm_cvtss_f32(_mm_rsqrt_ss(_mm_set_ss(x)));
+    return y * (1.5f - 0.5f * x * y * y);
+#else
+    return 1.0f / sqrtf(x);
+#endif
+}
+
+
 float boundary(float x) {
     if (x < -1.0f) {
         do {
@@ -145,20 +868,248 @@ float boundary(float x) {
 }
 
 
-void update(ParticleSystem *system) {
-    // pre-compute
-    float frictionFactor = pow(0.5, system->dt / system->frictionHalfLife);
+int matrixRowOffset(ParticleSystem *system, int type) {
+    // offset of the row belonging to "type" in the active matrix format
+    switch (system->activeMatrixFormat) {
+        case MATRIX_FORMAT_BLOCK:
+            return system->family[type] * system->numFamilies;
+        case MATRIX_FORMAT_LOW_RANK:
+            return type * system->rank;
+        default:
+            return type * system->m;
+    }
+}
+
+// constants of the pair loops, see getForceParams()
+typedef struct {
+    bool fast;                  // ACCURACY_FAST
+    float minSquared;           // pairs with minSquared < r * r <= maxSquared interact
+    float maxSquared;
+    float rMax;
+    float invRMax;
+} ForceParams;
+
+ForceParams getForceParams(ParticleSystem *system) {
+    ForceParams params;
+    params.fast = system->accuracy == ACCURACY_FAST;
+    params.rMax = system->rMax;
+    params.invRMax = 1.0f / system->rMax;
+    // no denormals for rsqrt
+    params.minSquared = params.fast ? FLT_MIN : 0.0f;
+    // the largest r * r with r < rMax, so that pairs out of range need no sqrt
+    float maxSquared = system->rMax * system->rMax;
+    if (params.fast) {
+        maxSquared = nextafterf(maxSquared, 0.0f);
+    } else {
+        // sqrtf() is monotonic, these are exactly the pairs with sqrtf(r * r) < rMax
+        while (sqrtf(maxSquared) >= system->rMax) {
+            maxSquared = nextafterf(maxSquared, 0.0f);
+        }
+        while (sqrtf(nextafterf(maxSquared, INFINITY)) < system->rMax) {
+            maxSquared = nextafterf(maxSquared, INFINITY);
+        }
+    }
+    params.maxSquared = maxSquared;
+    return params;
+}
+
+static inline void addPairForce(const ForceParams *params, float rx, float ry, float rSquared, float a,
+        float *forceX, float *forceY) {
+    if (params->fast) {
+        float invR = fastRsqrt(rSquared);
+        float f = fastForce(rSquared * invR * params->invRMax, a) * invR;
+        *forceX += rx * f;
+        *forceY += ry * f;
+    } else {
+        float r = sqrtf(rSquared);
+        float f = force(r / params->rMax, a);
+        *forceX += rx / r * f;
+        *forceY += ry / r * f;
+    }
+}
+
+void addGhostForces(ParticleSystem *system, ForceParams params, Particle *p, int rowOffset,
+        Particle *first, Particle *last, float *forceX, float *forceY) {
+    // forces of the ghosts [first, last) on p, with one loop per matrix format.
+    // the particle itself is skipped by r * r > minSquared
+    switch (system->activeMatrixFormat) {
+        case MATRIX_FORMAT_BLOCK: {
+            // the whole block matrix fits into L1, only "family" grows with m
+            const float *row = system->blockMatrix + rowOffset;
+            const int *family = system->family;
+            for (Particle *p_ = first; p_ < last; p_++) {
+                float rx = p_->x - p->x;
+                float ry = p_->y - p->y;
+                float rSquared = rx * rx + ry * ry;
+                if (!(rSquared > params.minSquared && rSquared <= params.maxSquared)) continue;
+                addPairForce(&params, rx, ry, rSquared, row[family[p_->type]], forceX, forceY);
+            }
+            break;
+        }
+        case MATRIX_FORMAT_LOW_RANK: {
+            const float *u = system->factorU + rowOffset;
+            int rank = system->rank;
+            for (Particle *p_ = first; p_ < last; p_++) {
+                float rx = p_->x - p->x;
+                float ry = p_->y - p->y;
+                float rSquared = rx * rx + ry * ry;
+                if (!(rSquared > params.minSquared && rSquared <= params.maxSquared)) continue;
+                const float *v = system->factorV + p_->type * rank;
+                float a = 0.0f;
+                for (int k = 0; k < rank; k++) {
+                    a += u[k] * v[k];
+                }
+                addPairForce(&params, rx, ry, rSquared, a, forceX, forceY);
+            }
+            break;
+        }
+        case MATRIX_FORMAT_QUANTIZED: {
+            const signed char *row = system->quantMatrix + rowOffset;
+            float scale = system->quantScale;
+            for (Particle *p_ = first; p_ < last; p_++) {
+                float rx = p_->x - p->x;
+                float ry = p_->y - p->y;
+                float rSquared = rx * rx + ry * ry;
+                if (!(rSquared > params.minSquared && rSquared <= params.maxSquared)) continue;
+                addPairForce(&params, rx, ry, rSquared, row[p_->type] * scale, forceX, forceY);
+            }
+            break;
+        }
+        default: {
+            const float *row = system->matrix + rowOffset;
+            for (Particle *p_ = first; p_ < last; p_++) {
+                float rx = p_->x - p->x;
+                float ry = p_->y - p->y;
+                float rSquared = rx * rx + ry * ry;
+                if (!(rSquared > params.minSquared && rSquared <= params.maxSquared)) continue;
+                addPairForce(&params, rx, ry, rSquared, row[p_->type], forceX, forceY);
+            }
+            break;
+        }
+    }
+}
+
+void addCellForces(ParticleSystem *system, ForceParams params, int i, int rowOffset,
+        int start, int stop, float *forceX, float *forceY) {
+    // like addGhostForces(), for the particles gridMap[start, stop) at wrapped distances
+    Particle *particles = system->particles;
+    const int *gridMap = system->gridMap;
+    Particle *p = &particles[i];
+    switch (system->activeMatrixFormat) {
+        case MATRIX_FORMAT_BLOCK: {
+            const float *row = system->blockMatrix + rowOffset;
+            const int *family = system->family;
+            for (int k = start; k < stop; k++) {
+                if (gridMap[k] == i) continue;
+                Particle *p_ = &particles[gridMap[k]];
+                float rx = boundary(p_->x - p->x);
+                float ry = boundary(p_->y - p->y);
+                float rSquared = rx * rx + ry * ry;
+                if (!(rSquared > params.minSquared && rSquared <= params.maxSquared)) continue;
+                addPairForce(&params, rx, ry, rSquared, row[family[p_->type]], forceX, forceY);
+            }
+            break;
+        }
+        case MATRIX_FORMAT_LOW_RANK: {
+            const float *u = system->factorU + rowOffset;
+            int rank = system->rank;
+            for (int k = start; k < stop; k++) {
+                if (gridMap[k] == i) continue;
+                Particle *p_ = &particles[gridMap[k]];
+                float rx = boundary(p_->x - p->x);
+                float ry = boundary(p_->y - p->y);
+                float rSquared = rx * rx + ry * ry;
+                if (!(rSquared > params.minSquared && rSquared <= params.maxSquared)) continue;
+                const float *v = system->factorV + p_->type * rank;
+                float a = 0.0f;
+                for (int r = 0; r < rank; r++) {
+                    a += u[r] * v[r];
+                }
+                addPairForce(&params, rx, ry, rSquared, a, forceX, forceY);
+            }
+            break;
+        }
+        case MATRIX_FORMAT_QUANTIZED: {
+            const signed char *row = system->quantMatrix + rowOffset;
+            float scale = system->quantScale;
+            for (int k = start; k < stop; k++) {
+                if (gridMap[k] == i) continue;
+                Particle *p_ = &particles[gridMap[k]];
+                float rx = boundary(p_->x - p->x);
+                float ry = boundary(p_->y - p->y);
+                float rSquared = rx * rx + ry * ry;
+                if (!(rSquared > params.minSquared && rSquared <= params.maxSquared)) continue;
+                addPairForce(&params, rx, ry, rSquared, row[p_->type] * scale, forceX, forceY);
+            }
+            break;
+        }
+        default: {
+            const float *row = system->matrix + rowOffset;
+            for (int k = start; k < stop; k++) {
+                if (gridMap[k] == i) continue;
+                Particle *p_ = &particles[gridMap[k]];
+                float rx = boundary(p_->x - p->x);
+                float ry = boundary(p_->y - p->y);
+                float rSquared = rx * rx + ry * ry;
+                if (!(rSquared > params.minSquared && rSquared <= params.maxSquared)) continue;
+                addPairForce(&params, rx, ry, rSquared, row[p_->type], forceX, forceY);
+            }
+            break;
+        }
+    }
+}
+
 
-    int gridSize = (int) floor(2.0f / system->rMax);
-    // ensure grid memory size (changes if rMax changes)
-    if (gridSize != system->gridSize) {
-        system->grid = (int*) realloc(system->grid,
-                sizeof(int) * (gridSize * gridSize + 1));
-        system->gridSize = gridSize;
+void reserveCellTypes(ParticleSystem *system) {
+    // only allocated once the drawing asks for them
+    int numCellTypes = system->gridSize * system->gridSize * system->m;
+    if (numCellTypes > system->cellTypesCapacity) {
+        int capacity = (numCellTypes > 2 * system->cellTypesCapacity) ? numCellTypes : 2 * system->cellTypesCapacity;
+        arenaRelease(system->arena, system->cellTypes, system->cellTypesCapacity * sizeof(int));
+        system->cellTypes = arenaAlloc(system->arena, capacity * sizeof(int), false);
+        system->cellTypesCapacity = capacity;
+    }
+}
+
+void resizeGrid(ParticleSystem *system) {
+    // call whenever rMax changes, so that update() never allocates
+    int gridSize = (int) floor(2.0f * system->cellDivisor / system->rMax);
+    int numCells = gridSize * gridSize + 1;
+    if (numCells > system->gridCapacity) {
+        int capacity = (numCells > 2 * system->gridCapacity) ? numCells : 2 * system->gridCapacity;
+        arenaRelease(system->arena, system->grid, system->gridCapacity * sizeof(int));
+        system->grid = arenaAlloc(system->arena, capacity * sizeof(int), false);
+        system->gridCapacity = capacity;
+    }
+    system->gridSize = gridSize;
+    system->gridCurrent = false;
+    if (system->cellTypesWanted) reserveCellTypes(system);
+    if (system->ghostCells) {
+        int paddedSize = gridSize + 2 * system->cellDivisor;
+        int numPaddedCells = paddedSize * paddedSize + 1;
+        if (numPaddedCells > system->ghostGridCapacity) {
+            int capacity = (numPaddedCells > 2 * system->ghostGridCapacity) ? numPaddedCells : 2 * system->ghostGridCapacity;
+            arenaRelease(system->arena, system->ghostGrid, system->ghostGridCapacity * sizeof(int));
+            system->ghostGrid = arenaAlloc(system->arena, capacity * sizeof(int), false);
+            system->ghostGridCapacity = capacity;
+        }
     }
-    if (gridSize < 3) {
+}
+
+int cellCoordinate(float x, int gridSize) {
+    // x + 1.0f rounds up to 2.0f for x just below 1.0f
+    int c = (int) floor((x + 1.0f) * 0.5f * (float) gridSize);
+    return (c < gridSize) ? c : gridSize - 1;
+}
+
+bool buildGrid(ParticleSystem *system) {
+    // sorts particle indices into cells of size >= rMax / cellDivisor.
+    // returns false if the grid would be too coarse.
+    int gridSize = system->gridSize;
+    system->gridCurrent = false;
+    if (gridSize < 2 * system->cellDivisor + 1) {
         // todo: throw error
-        return;
+        return false;
     }
 
     // shorthands
@@ -170,13 +1121,26 @@ void update(ParticleSystem *system) {
     for (int i = 0; i < gridSize * gridSize; i++) {
         grid[i] = 0;
     }
-    // count particles in cells
-    for (int i = 0; i < system->n; i++) {
-        Particle *p = &particles[i];
-        int cx = (int) floor((p->x + 1.0f) * 0.5f * (float) gridSize);
-        int cy = (int) floor((p->y + 1.0f) * 0.5f * (float) gridSize);
-        int gridIndex = cx + cy * gridSize;
-        grid[gridIndex]++;
+    // count particles in cells, by type too while drawing zoomed out
+    int m = system->m;
+    bool countTypes = system->cellTypesWanted && gridSize * gridSize * m <= system->cellTypesCapacity;
+    if (countTypes) {
+        int *cellTypes = system->cellTypes;
+        memset(cellTypes, 0, (size_t) gridSize * gridSize * m * sizeof(int));
+        for (int i = 0; i < system->n; i++) {
+            Particle *p = &particles[i];
+            int gridIndex = cellCoordinate(p->x, gridSize) + cellCoordinate(p->y, gridSize) * gridSize;
+            grid[gridIndex]++;
+            cellTypes[gridIndex * m + p->type]++;
+        }
+    } else {
+        for (int i = 0; i < system->n; i++) {
+            Particle *p = &particles[i];
+            int cx = cellCoordinate(p->x, gridSize);
+            int cy = cellCoordinate(p->y, gridSize);
+            int gridIndex = cx + cy * gridSize;
+            grid[gridIndex]++;
+        }
     }
     // cumsum
     int sum = 0;
@@ -188,8 +1152,8 @@ void update(ParticleSystem *system) {
     // pointers to cell index
     for (int i = 0; i < system->n; i++) {
         Particle *p = &particles[i];
-        int cx = (int) floor((p->x + 1.0f) * 0.5f * (float) gridSize);
-        int cy = (int) floor((p->y + 1.0f) * 0.5f * (float) gridSize);
+        int cx = cellCoordinate(p->x, gridSize);
+        int cy = cellCoordinate(p->y, gridSize);
         int gridIndex = cx + cy * gridSize;
         int particleIndex = grid[gridIndex];
         grid[gridIndex]++;
@@ -201,180 +1165,1270 @@ void update(ParticleSystem *system) {
     }
     grid[0] = 0;
     // todo: copy actual particle structs to avoid additional lookups
+    system->cellTypesCurrent = countTypes;
+    system->gridCurrent = true;
+    return true;
+}
 
-    // velocities
-    for (int cy = 0; cy < gridSize; cy++) {
-        for (int cx = 0; cx < gridSize; cx++) {
-
-            int gridIndex = cx + cy * gridSize;
-            int start = grid[gridIndex];
-            int stop = grid[gridIndex + 1];
-            for (int k = start; k < stop; k++) {
-                int i = gridMap[k];
-                Particle *p = &particles[i];
-
-                float totalForceX = 0.0f;
-                float totalForceY = 0.0f;
-
-                for (int dy = -1; dy <= 1; dy++) {
-                    for (int dx = -1; dx <= 1; dx++) {
-                        int cx_ = cx + dx;
-                        int cy_ = cy + dy;
-
-                        // wrap around
-                        if (cx_ < 0) cx_ += gridSize;
-                        if (cx_ >= gridSize) cx_ -= gridSize;
-                        if (cy_ < 0) cy_ += gridSize;
-                        if (cy_ >= gridSize) cy_ -= gridSize;
-
-                        int c_ = cx_ + cy_ * gridSize;
-
-                        int start_ = grid[c_];
-                        int stop_ = grid[c_ + 1];
-                        for (int k_ = start_; k_ < stop_; k_++) {
-                            int i_ = gridMap[k_];
-                            if (i_ == i) continue;
-                            Particle *p_ = &particles[i_];
-
-                            float rx = boundary(p_->x - p->x);
-                            float ry = boundary(p_->y - p->y);
-                            float rSquared = rx * rx + ry * ry;
-                            float r = sqrtf(rSquared);
-                            if (r > 0.0f && r < system->rMax) {
-                                float a = system->matrix[p->type * system->m + p_->type];
-                                float f = force(r / system->rMax, a);
-                                totalForceX += rx / r * f;
-                                totalForceY += ry / r * f;
-                            }
-                        }
-                    }
-                }
-
-                totalForceX *= system->rMax * system->forceFactor;
-                totalForceY *= system->rMax * system->forceFactor;
+void copyGhostRows(ParticleSystem *system, int rowStart, int rowStop) {
+    int gridSize = system->gridSize;
+    int reach = system->cellDivisor;
+    int paddedSize = gridSize + 2 * reach;
+    for (int py = rowStart; py < rowStop; py++) {
+        int cy = py - reach;
+        float shiftY = 0.0f;
+        if (cy < 0) {
+            cy += gridSize;
+            shiftY = -2.0f;
+        } else if (cy >= gridSize) {
+            cy -= gridSize;
+            shiftY = 2.0f;
+        }
+        for (int px = 0; px < paddedSize; px++) {
+            int cx = px - reach;
+            float shiftX = 0.0f;
+            if (cx < 0) {
+                cx += gridSize;
+                shiftX = -2.0f;
+            } else if (cx >= gridSize) {
+                cx -= gridSize;
+                shiftX = 2.0f;
+            }
+            int c = cx + cy * gridSize;
+            Particle *ghost = &system->ghostParticles[system->ghostGrid[px + py * paddedSize]];
+            for (int k = system->grid[c]; k < system->grid[c + 1]; k++) {
+                *ghost = system->particles[system->gridMap[k]];
+                ghost->x += shiftX;
+                ghost->y += shiftY;
+                ghost++;
+            }
+        }
+    }
+}
 
-                p->vx *= frictionFactor;
-                p->vy *= frictionFactor;
+void ghostJob(void *arg, int thread, int numThreads) {
+    ParticleSystem *system = (ParticleSystem *) arg;
+    int paddedSize = system->gridSize + 2 * system->cellDivisor;
+    copyGhostRows(system, paddedSize * thread / numThreads, paddedSize * (thread + 1) / numThreads);
+}
 
-                p->vx += totalForceX * system->dt;
-                p->vy += totalForceY * system->dt;
-            }
+void buildGhostCells(ParticleSystem *system) {
+    // copies all particles in cell order into a grid padded by cellDivisor cells on each side.
+    // the padding repeats the cells of the opposite boundary, shifted by +-2, so that
+    // neighbours are found without wrapping around.
+    // a cell appears at most twice per axis (gridSize >= 2 * reach + 1), i.e. at most 4 * n copies.
+    int gridSize = system->gridSize;
+    int reach = system->cellDivisor;
+    int paddedSize = gridSize + 2 * reach;
+    int sum = 0;
+    for (int py = 0; py < paddedSize; py++) {
+        int cy = (py - reach + gridSize) % gridSize;
+        for (int px = 0; px < paddedSize; px++) {
+            int cx = (px - reach + gridSize) % gridSize;
+            int c = cx + cy * gridSize;
+            system->ghostGrid[px + py * paddedSize] = sum;
+            sum += system->grid[c + 1] - system->grid[c];
         }
     }
+    system->ghostGrid[paddedSize * paddedSize] = sum;
 
-    // positions
-    for (int i = 0; i < system->n; i++) {
-        Particle *particle = &particles[i];
-        particle->x = boundary(particle->x + particle->vx * system->dt);
-        particle->y = boundary(particle->y + particle->vy * system->dt);
+    if (system->threads != NULL && system->threads->activeThreads > 1) {
+        runJob(system->threads, ghostJob, system);
+    } else {
+        copyGhostRows(system, 0, paddedSize);
     }
 }
 
-void renderDensity(int *grid, int w, int h,
-        ParticleSystem *system,
-        float zoom, float shiftX, float shiftY, bool clear) {
-    int n = system->n;
-    int m = system->m;
+void updateVelocitiesGhost(ParticleSystem *system, int count, int cellStart, int cellStop) {
+    // like updateVelocities(), but reads the positions from the ghost cells
+    float frictionFactor = pow(0.5, system->dt / system->frictionHalfLife);
+
+    // shorthands
+    int gridSize = system->gridSize;
+    int *grid = system->grid;
+    int *gridMap = system->gridMap;
+    int *ghostGrid = system->ghostGrid;
+    Particle *ghosts = system->ghostParticles;
+    int reach = system->cellDivisor;
+    ForceParams params = getForceParams(system);
+    int paddedSize = gridSize + 2 * reach;
 
-    if (clear) memset(grid, 0, w * h * m * sizeof(int));
+    for (int gridIndex = cellStart; gridIndex < cellStop; gridIndex++) {
+        int cx = gridIndex % gridSize;
+        int cy = gridIndex / gridSize;
+        int ghostIndex = (cx + reach) + (cy + reach) * paddedSize;
 
-    int w_cw = w;
-    int h_cw = h * CHAR_RATIO;
+        int start = grid[gridIndex];
+        int stop = grid[gridIndex + 1];
+        int ghostOffset = ghostGrid[ghostIndex] - start;
+        for (int k = start; k < stop; k++) {
+            int i = gridMap[k];
+            if (i >= count) continue;
+            Particle *p = &ghosts[ghostOffset + k];
+            int rowOffset = matrixRowOffset(system, p->type);
 
-    for (int i = 0; i < n; i++) {
-        Particle *p = &(system->particles[i]);
-        float x_cw = (p->x + shiftX) * zoom * h_cw / 2 + w_cw / 2;
-        float y_cw = (p->y + shiftY) * zoom * h_cw / 2 + h_cw / 2;
+            float totalForceX = 0.0f;
+            float totalForceY = 0.0f;
 
-        int x = (int) floor(x_cw);
-        int y = (int) floor(y_cw / CHAR_RATIO);
+            for (int dy = -reach; dy <= reach; dy++) {
+                // the cells of a row are contiguous
+                int rowIndex = ghostIndex + dy * paddedSize;
+                addGhostForces(system, params, p, rowOffset, &ghosts[ghostGrid[rowIndex - reach]],
+                        &ghosts[ghostGrid[rowIndex + reach + 1]], &totalForceX, &totalForceY);
+            }
+
+            totalForceX *= system->rMax * system->forceFactor;
+            totalForceY *= system->rMax * system->forceFactor;
+
+            Particle *particle = &system->particles[i];
+            particle->vx *= frictionFactor;
+            particle->vy *= frictionFactor;
 
-        if (x >= 0 && x < w && y >= 0 && y < h) {
-            grid[y * w * m + x * m + p->type]++;
+            particle->vx += totalForceX * system->dt;
+            particle->vy += totalForceY * system->dt;
         }
     }
 }
 
-void renderText(ParticleSystem *system, UiSettings *ui, int *densityGridBuf) {
-    int w = ui->w;
-    int h = ui->h;
-    int colorMode = ui->colorMode;
-    int m = system->m;
-    char *densityChars = ui->densityChars;
-    size_t densityCharsLen = strlen(densityChars);
-    
-    if (ui->printInPlace) {
-        if (ui->printInPlaceIsFirstFrame) {
-            ui->printInPlaceIsFirstFrame = false;
-        } else {
-            // move cursor up
-            printf("\033[%dA", h);
-        }
-    }
+void updateVelocities(ParticleSystem *system, int count, int cellStart, int cellStop) {
+    // updates the particles in cells [cellStart, cellStop).
+    // only particles with index < count are accelerated,
+    // the others (e.g. halo copies) merely exert forces
+    float frictionFactor = pow(0.5, system->dt / system->frictionHalfLife);
 
-    // draw grid
-    for (int y = 0; y < h; y++) {
-        for (int x = 0; x < w; x++) {
-            // find most common particle type
-            int maxType = 0;
-            int maxCount = 0;
-            int offset = y * w * m + x * m;
-            for (int i = 0; i < m; i++) {
-                int count = densityGridBuf[offset + i];
-                if (count > maxCount) {
-                    maxType = i;
-                    maxCount = count;
+    // shorthands
+    int gridSize = system->gridSize;
+    int *grid = system->grid;
+    int *gridMap = system->gridMap;
+    Particle *particles = system->particles;
+    int reach = system->cellDivisor;
+    ForceParams params = getForceParams(system);
+
+    if (system->forceKernel != NULL) {
+        system->forceKernel(particles, count, cellStart, cellStop, gridSize, system->cellDivisor, grid, gridMap,
+                system->m, system->matrix, system->rMax, system->forceFactor, frictionFactor, system->dt);
+        return;
+    }
+    if (system->ghostCells) {
+        updateVelocitiesGhost(system, count, cellStart, cellStop);
+        return;
+    }
+
+    for (int gridIndex = cellStart; gridIndex < cellStop; gridIndex++) {
+        int cx = gridIndex % gridSize;
+        int cy = gridIndex / gridSize;
+
+        int start = grid[gridIndex];
+        int stop = grid[gridIndex + 1];
+        for (int k = start; k < stop; k++) {
+            int i = gridMap[k];
+            if (i >= count) continue;
+            Particle *p = &particles[i];
+            int rowOffset = matrixRowOffset(system, p->type);
+
+            float totalForceX = 0.0f;
+            float totalForceY = 0.0f;
+
+            for (int dy = -reach; dy <= reach; dy++) {
+                for (int dx = -reach; dx <= reach; dx++) {
+                    int cx_ = cx + dx;
+                    int cy_ = cy + dy;
+
+                    // wrap around
+                    if (cx_ < 0) cx_ += gridSize;
+                    if (cx_ >= gridSize) cx_ -= gridSize;
+                    if (cy_ < 0) cy_ += gridSize;
+                    if (cy_ >= gridSize) cy_ -= gridSize;
+
+                    int c_ = cx_ + cy_ * gridSize;
+                    addCellForces(system, params, i, rowOffset, grid[c_], grid[c_ + 1], &totalForceX, &totalForceY);
                 }
             }
-            // draw character
-            if (maxCount == 0) {
-                putchar(' ');
-            } else {
-                size_t index = (size_t) maxCount - 1;
-                if (index > densityCharsLen - 1) {
-                    index = densityCharsLen - 1;
-                }
-                char c = densityChars[index];
-                if (colorMode == 1) {
-                    printf("\033[38;5;%dm", maxType + 1);
+
+            totalForceX *= system->rMax * system->forceFactor;
+            totalForceY *= system->rMax * system->forceFactor;
+
+            p->vx *= frictionFactor;
+            p->vy *= frictionFactor;
+
+            p->vx += totalForceX * system->dt;
+            p->vy += totalForceY * system->dt;
+        }
+    }
+}
+
+float updatePositions(ParticleSystem *system, int start, int stop) {
+    // returns the farthest any of the particles moved along x or y
+    float maxMove = 0.0f;
+    for (int i = start; i < stop; i++) {
+        Particle *particle = &system->particles[i];
+        float dx = particle->vx * system->dt;
+        float dy = particle->vy * system->dt;
+        particle->x = boundary(particle->x + dx);
+        particle->y = boundary(particle->y + dy);
+        float move = fmaxf(fabsf(dx), fabsf(dy));
+        maxMove = move > maxMove ? move : maxMove;
+    }
+    return maxMove;
+}
+
+int balancedCell(ParticleSystem *system, int part, int numParts) {
+    // first cell of the part-th of numParts cell ranges with equal particle counts
+    int numCells = system->gridSize * system->gridSize;
+    if (part >= numParts) return numCells;
+    int target = (int) ((long long) system->n * part / numParts);
+    int lo = 0;
+    int hi = numCells;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (system->grid[mid] < target) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+void velocityJob(void *arg, int thread, int numThreads) {
+    ParticleSystem *system = (ParticleSystem *) arg;
+    updateVelocities(system, system->n,
+            balancedCell(system, thread, numThreads), balancedCell(system, thread + 1, numThreads));
+}
+
+typedef struct {
+    ParticleSystem *system;
+    float *moves;   // of each thread, see updatePositions()
+} PositionJob;
+
+void positionJob(void *arg, int thread, int numThreads) {
+    PositionJob *job = (PositionJob *) arg;
+    ParticleSystem *system = job->system;
+    job->moves[thread] = updatePositions(system,
+            (int) ((long long) system->n * thread / numThreads),
+            (int) ((long long) system->n * (thread + 1) / numThreads));
+}
+
+void reorderJob(void *arg, int thread, int numThreads) {
+    // copies the particles into cell order, gridMap becomes the identity
+    ParticleSystem *system = (ParticleSystem *) arg;
+    int start = (int) ((long long) system->n * thread / numThreads);
+    int stop = (int) ((long long) system->n * (thread + 1) / numThreads);
+    for (int k = start; k < stop; k++) {
+        system->spareParticles[k] = system->particles[system->gridMap[k]];
+        system->gridMap[k] = k;
+    }
+}
+
+void reorderParticles(ParticleSystem *system) {
+    // neighbours become neighbours in memory, too
+    if (system->threads != NULL) {
+        runJob(system->threads, reorderJob, system);
+    } else {
+        reorderJob(system, 0, 1);
+    }
+    Particle *temp = system->particles;
+    system->particles = system->spareParticles;
+    system->spareParticles = temp;
+    system->layoutVersion++;
+}
+
+void update(ParticleSystem *system) {
+    if (!buildGrid(system)) return;
+    if (system->reorderInterval > 0 && ++system->stepsSinceReorder >= system->reorderInterval) {
+        reorderParticles(system);
+        system->stepsSinceReorder = 0;
+    }
+    if (system->ghostCells && system->forceKernel == NULL) {
+        buildGhostCells(system);
+    }
+    if (system->threads != NULL && system->threads->activeThreads > 1) {
+        int numThreads = system->threads->activeThreads;
+        float moves[numThreads];
+        PositionJob job = {system, moves};
+        runJob(system->threads, velocityJob, system);
+        runJob(system->threads, positionJob, &job);
+        system->maxMove = 0.0f;
+        for (int t = 0; t < numThreads; t++) {
+            if (moves[t] > system->maxMove) system->maxMove = moves[t];
+        }
+    } else {
+        updateVelocities(system, system->n, 0, system->gridSize * system->gridSize);
+        system->maxMove = updatePositions(system, 0, system->n);
+    }
+}
+
+// source of a runtime-compiled force kernel, "%s" is the force expression.
+// Particle and boundary() must match the definitions in this file.
+const char *forceKernelTemplate =
+    "#include <math.h>\n"
+    "\n"
+    "typedef struct { int type; float x; float y; float vx; float vy; } Particle;\n"
+    "\n"
+    "int kernelParticleSize = sizeof(Particle);\n"
+    "\n"
+    "static inline float boundary(float x) {\n"
+    "    while (x < -1.0f) x += 2.0f;\n"
+    "    while (x >= 1.0f) x -= 2.0f;\n"
+    "    return x;\n"
+    "}\n"
+    "\n"
+    "static inline float force(float r, float a) {\n"
+    "    return (%s);\n"
+    "}\n"
+    "\n"
+    "void forceKernel(Particle *particles, int count, int cellStart, int cellStop,\n"
+    "        int gridSize, int reach, int *grid, int *gridMap,\n"
+    "        int m, float *matrix, float rMax, float forceFactor, float frictionFactor, float dt) {\n"
+    "    const float invRMax = 1.0f / rMax;\n"
+    "    for (int c = cellStart; c < cellStop; c++) {\n"
+    "        int cx = c %% gridSize;\n"
+    "        int cy = c / gridSize;\n"
+    "        int stop = grid[c + 1];\n"
+    "        for (int k = grid[c]; k < stop; k++) {\n"
+    "            int i = gridMap[k];\n"
+    "            if (i >= count) continue;\n"
+    "            Particle *p = &particles[i];\n"
+    "            const float *row = matrix + p->type * m;\n"
+    "            float totalForceX = 0.0f;\n"
+    "            float totalForceY = 0.0f;\n"
+    "            for (int dy = -reach; dy <= reach; dy++) {\n"
+    "                int cy_ = cy + dy;\n"
+    "                if (cy_ < 0) cy_ += gridSize;\n"
+    "                if (cy_ >= gridSize) cy_ -= gridSize;\n"
+    "                for (int dx = -reach; dx <= reach; dx++) {\n"
+    "                    int cx_ = cx + dx;\n"
+    "                    if (cx_ < 0) cx_ += gridSize;\n"
+    "                    if (cx_ >= gridSize) cx_ -= gridSize;\n"
+    "                    int c_ = cx_ + cy_ * gridSize;\n"
+    "                    int stop_ = grid[c_ + 1];\n"
+    "                    for (int k_ = grid[c_]; k_ < stop_; k_++) {\n"
+    "                        int i_ = gridMap[k_];\n"
+    "                        if (i_ == i) continue;\n"
+    "                        const Particle *p_ = &particles[i_];\n"
+    "                        float rx = boundary(p_->x - p->x);\n"
+    "                        float ry = boundary(p_->y - p->y);\n"
+    "                        float r = sqrtf(rx * rx + ry * ry);\n"
+    "                        if (r > 0.0f && r < rMax) {\n"
+    "                            float f = force(r * invRMax, row[p_->type]);\n"
+    "                            totalForceX += rx / r * f;\n"
+    "                            totalForceY += ry / r * f;\n"
+    "                        }\n"
+    "                    }\n"
+    "                }\n"
+    "            }\n"
+    "            p->vx = p->vx * frictionFactor + totalForceX * (rMax * forceFactor) * dt;\n"
+    "            p->vy = p->vy * frictionFactor + totalForceY * (rMax * forceFactor) * dt;\n"
+    "        }\n"
+    "    }\n"
+    "}\n";
+
+unsigned long long hashString(const char *str, unsigned long long hash) {
+    // FNV-1a, pass 14695981039346656037 as initial hash
+    for (; *str != '\0'; str++) {
+        hash ^= (unsigned char) *str;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+unsigned long long hashBytes(const void *data, size_t size, unsigned long long hash) {
+    // like hashString()
+    for (size_t i = 0; i < size; i++) {
+        hash ^= ((const unsigned char *) data)[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+bool cacheDirectory(char *dir, size_t size) {
+    // $XDG_CACHE_HOME/particle-life or ~/.cache/particle-life, created if missing
+#ifdef __unix__
+    const char *cacheHome = getenv("XDG_CACHE_HOME");
+    if (cacheHome != NULL && cacheHome[0] != '\0') {
+        snprintf(dir, size, "%s", cacheHome);
+    } else {
+        const char *home = getenv("HOME");
+        snprintf(dir, size, "%s/.cache", home != NULL ? home : "/tmp");
+    }
+    mkdir(dir, 0755);
+    strncat(dir, "/particle-life", size - strlen(dir) - 1);
+    mkdir(dir, 0755);
+    return access(dir, W_OK) == 0;
+#else
+    return false;
+#endif
+}
+
+ForceKernel compileForceKernel(const char *expr) {
+    // generates a specialized velocity loop for "expr", compiles it into a
+    // shared object in the cache directory (keyed by the hash of source and
+    // compiler command) and loads it. returns NULL on failure.
+#ifdef __unix__
+    const char *compiler = getenv("CC");
+    if (compiler == NULL || compiler[0] == '\0') compiler = "cc";
+    const char *flags = "-O3 -shared -fPIC -lm";
+
+    size_t sourceLen = strlen(forceKernelTemplate) + strlen(expr);
+    char *source = malloc(sourceLen + 1);
+    snprintf(source, sourceLen + 1, forceKernelTemplate, expr);
+
+    unsigned long long hash = hashString(source, 14695981039346656037ULL);
+    hash = hashString(compiler, hash);
+    hash = hashString(flags, hash);
+
+    char dir[1024];
+    cacheDirectory(dir, sizeof(dir));
+
+    char soPath[1100];
+    snprintf(soPath, sizeof(soPath), "%s/kernel-%016llx.so", dir, hash);
+
+    if (access(soPath, R_OK) != 0) {
+        char srcPath[1100];
+        char tmpPath[1100];
+        snprintf(srcPath, sizeof(srcPath), "%s/kernel-%016llx.c", dir, hash);
+        snprintf(tmpPath, sizeof(tmpPath), "%s/kernel-%016llx.so.%d", dir, hash, (int) getpid());
+
+        FILE *file = fopen(srcPath, "w");
+        if (file == NULL) {
+            fprintf(stderr, "could not write %s\n", srcPath);
+            free(source);
+            return NULL;
+        }
+        fputs(source, file);
+        fclose(file);
+
+        char command[4096];
+        snprintf(command, sizeof(command), "%s -o '%s' '%s' %s", compiler, tmpPath, srcPath, flags);
+        if (system(command) != 0) {
+            fprintf(stderr, "could not compile force kernel with \"%s\"\n", compiler);
+            remove(tmpPath);
+            free(source);
+            return NULL;
+        }
+        // atomic, so that concurrent runs never load a half-written object
+        rename(tmpPath, soPath);
+    }
+    free(source);
+
+    void *lib = dlopen(soPath, RTLD_NOW | RTLD_LOCAL);
+    if (lib == NULL) {
+        fprintf(stderr, "could not load force kernel: %s\n", dlerror());
+        return NULL;
+    }
+    int *particleSize = (int *) dlsym(lib, "kernelParticleSize");
+    ForceKernel kernel = (ForceKernel) dlsym(lib, "forceKernel");
+    if (particleSize == NULL || *particleSize != (int) sizeof(Particle) || kernel == NULL) {
+        fprintf(stderr, "force kernel %s is incompatible\n", soPath);
+        dlclose(lib);
+        return NULL;
+    }
+    return kernel;
+#else
+    fprintf(stderr, "compiled force kernels are not supported on this platform\n");
+    return NULL;
+#endif
+}
+
+#ifdef __unix__
+// Multi-process domain decomposition: the domain is split into horizontal
+// slabs, one per worker process. Each step, workers exchange halo particles
+// (within rMax of a slab edge) and migrating particles with their two
+// neighbours through shared memory queues, separated by a process-shared
+// barrier.
+
+typedef struct {
+    int numOwned;
+    Particle *owned;       // owned particles, followed by the halo during a step
+    int numHaloUp;
+    int numHaloDown;
+    int numMigrateUp;
+    int numMigrateDown;
+    Particle *haloUp;      // copies for the slab above
+    Particle *haloDown;    // copies for the slab below
+    Particle *migrateUp;   // particles handed over to the slab above
+    Particle *migrateDown; // particles handed over to the slab below
+} DomainSlab;
+
+typedef struct {
+    pthread_barrier_t frameBarrier;  // parent and workers
+    pthread_barrier_t stepBarrier;   // workers only
+    int steps;                       // steps per frame, -1 to quit
+    ParticleSystem params;           // copy of the parent's settings
+} DomainControl;
+
+typedef struct {
+    int numWorkers;
+    int capacity;
+    DomainControl *control;
+    DomainSlab *slabs;
+    pid_t *pids;
+} Domain;
+
+int slabIndex(float y, int numWorkers) {
+    int w = (int) floor((y + 1.0f) * 0.5f * (float) numWorkers);
+    if (w < 0) return 0;
+    if (w >= numWorkers) return numWorkers - 1;
+    return w;
+}
+
+void domainScatter(Domain *domain, ParticleSystem *system) {
+    // distribute the parent's particles among the slabs
+    for (int w = 0; w < domain->numWorkers; w++) {
+        domain->slabs[w].numOwned = 0;
+    }
+    for (int i = 0; i < system->n; i++) {
+        DomainSlab *slab = &domain->slabs[slabIndex(system->particles[i].y, domain->numWorkers)];
+        slab->owned[slab->numOwned++] = system->particles[i];
+    }
+}
+
+void domainGather(Domain *domain, ParticleSystem *system) {
+    // collect the particles of all slabs (in slab order)
+    int n = 0;
+    for (int w = 0; w < domain->numWorkers; w++) {
+        DomainSlab *slab = &domain->slabs[w];
+        memcpy(system->particles + n, slab->owned, slab->numOwned * sizeof(Particle));
+        n += slab->numOwned;
+    }
+    system->layoutVersion++;
+}
+
+void domainWorkerStep(Domain *domain, int w, ParticleSystem *local) {
+    int numWorkers = domain->numWorkers;
+    float slabHeight = 2.0f / (float) numWorkers;
+    float y0 = -1.0f + w * slabHeight;
+    float y1 = y0 + slabHeight;
+    float rMax = local->rMax;
+    DomainSlab *slab = &domain->slabs[w];
+    DomainSlab *below = &domain->slabs[(w + numWorkers - 1) % numWorkers];
+    DomainSlab *above = &domain->slabs[(w + 1) % numWorkers];
+
+    // send halo. with two workers, the slab below is also the one above and
+    // must receive each particle only once (both edges overlap for rMax > 0.5)
+    slab->numHaloUp = 0;
+    slab->numHaloDown = 0;
+    for (int i = 0; i < slab->numOwned; i++) {
+        Particle *p = &slab->owned[i];
+        bool down = p->y < y0 + rMax;
+        bool up = p->y >= y1 - rMax;
+        if (below == above) {
+            if (down || up) slab->haloUp[slab->numHaloUp++] = *p;
+            continue;
+        }
+        if (down) slab->haloDown[slab->numHaloDown++] = *p;
+        if (up) slab->haloUp[slab->numHaloUp++] = *p;
+    }
+    pthread_barrier_wait(&domain->control->stepBarrier);
+
+    // receive halo and simulate
+    int numOwned = slab->numOwned;
+    int n = numOwned;
+    memcpy(slab->owned + n, below->haloUp, below->numHaloUp * sizeof(Particle));
+    n += below->numHaloUp;
+    memcpy(slab->owned + n, above->haloDown, above->numHaloDown * sizeof(Particle));
+    n += above->numHaloDown;
+    local->particles = slab->owned;
+    local->n = n;
+    if (buildGrid(local)) {
+        updateVelocities(local, numOwned, 0, local->gridSize * local->gridSize);
+        updatePositions(local, 0, numOwned);
+    }
+
+    // send particles that left the slab.
+    // (particles moving further than one slab are forwarded on the next step)
+    slab->numMigrateUp = 0;
+    slab->numMigrateDown = 0;
+    for (int i = 0; i < numOwned;) {
+        int dest = slabIndex(slab->owned[i].y, numWorkers);
+        if (dest == w) {
+            i++;
+            continue;
+        }
+        int stepsUp = (dest - w + numWorkers) % numWorkers;
+        if (stepsUp <= numWorkers - stepsUp) {
+            slab->migrateUp[slab->numMigrateUp++] = slab->owned[i];
+        } else {
+            slab->migrateDown[slab->numMigrateDown++] = slab->owned[i];
+        }
+        slab->owned[i] = slab->owned[--numOwned];
+    }
+    pthread_barrier_wait(&domain->control->stepBarrier);
+
+    // receive migrants
+    memcpy(slab->owned + numOwned, below->migrateUp, below->numMigrateUp * sizeof(Particle));
+    numOwned += below->numMigrateUp;
+    memcpy(slab->owned + numOwned, above->migrateDown, above->numMigrateDown * sizeof(Particle));
+    numOwned += above->numMigrateDown;
+    slab->numOwned = numOwned;
+}
+
+void domainWorker(Domain *domain, int w, bool pin) {
+    DomainControl *control = domain->control;
+
+    if (pin) {
+        // keep the slab on the node of the worker's core
+        pinCurrentThread(w);
+        DomainSlab *slab = &domain->slabs[w];
+        moveToLocalNode(slab->owned, slab->numOwned * sizeof(Particle));
+    }
+
+    // private cell list of owned and halo particles,
+    // allocated from this process' copy of the arena
+    ParticleSystem local = control->params;
+    local.gridCapacity = 0;
+    local.grid = NULL;
+    local.gridMap = arenaAlloc(local.arena, 2 * domain->capacity * sizeof(int), false);
+
+    while (true) {
+        pthread_barrier_wait(&control->frameBarrier);
+        if (control->steps < 0) break;
+
+        // take over the parent's settings, keep the private buffers
+        ParticleSystem params = control->params;
+        params.threads = NULL;  // threads are not inherited by fork()
+        params.reorderInterval = 0;  // no spare buffer for owned + halo
+        params.ghostCells = false;  // slabs are not periodic in y
+        params.gridCapacity = local.gridCapacity;
+        params.grid = local.grid;
+        params.gridMap = local.gridMap;
+        params.cellTypesWanted = false;  // the slabs are not drawn
+        local = params;
+        resizeGrid(&local);
+        for (int i = 0; i < control->steps; i++) {
+            domainWorkerStep(domain, w, &local);
+        }
+
+        pthread_barrier_wait(&control->frameBarrier);
+    }
+}
+
+bool domainStart(Domain *domain, ParticleSystem *system, bool pin) {
+    int numWorkers = domain->numWorkers;
+    int n = system->n;
+    domain->capacity = n;
+
+    // owned + halo (2n) and four queues (n each) per slab.
+    // (the matrix buffers are already shared, see main())
+    size_t slabBytes = 6 * (size_t) n * sizeof(Particle);
+    char *mem = arenaAlloc(system->arena,
+            sizeof(DomainControl) + numWorkers * (sizeof(DomainSlab) + slabBytes), true);
+    domain->control = (DomainControl *) mem;
+    domain->slabs = (DomainSlab *) (mem + sizeof(DomainControl));
+    Particle *data = (Particle *) (mem + sizeof(DomainControl) + numWorkers * sizeof(DomainSlab));
+    for (int w = 0; w < numWorkers; w++) {
+        DomainSlab *slab = &domain->slabs[w];
+        Particle *slabData = data + (size_t) w * 6 * n;
+        slab->owned = slabData;
+        slab->haloUp = slabData + 2 * (size_t) n;
+        slab->haloDown = slabData + 3 * (size_t) n;
+        slab->migrateUp = slabData + 4 * (size_t) n;
+        slab->migrateDown = slabData + 5 * (size_t) n;
+    }
+
+    pthread_barrierattr_t attr;
+    pthread_barrierattr_init(&attr);
+    pthread_barrierattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_barrier_init(&domain->control->frameBarrier, &attr, numWorkers + 1);
+    pthread_barrier_init(&domain->control->stepBarrier, &attr, numWorkers);
+    pthread_barrierattr_destroy(&attr);
+
+    domainScatter(domain, system);
+    domain->control->params = *system;
+
+    fflush(stdout);
+    domain->pids = malloc(numWorkers * sizeof(pid_t));
+    for (int w = 0; w < numWorkers; w++) {
+        pid_t pid = fork();
+        if (pid == 0) {
+#ifdef __linux__
+            prctl(PR_SET_PDEATHSIG, SIGTERM);
+#endif
+            domainWorker(domain, w, pin);
+            _exit(0);
+        }
+        if (pid < 0) {
+            fprintf(stderr, "could not fork worker %d\n", w);
+            return false;
+        }
+        domain->pids[w] = pid;
+    }
+    return true;
+}
+
+void domainStep(Domain *domain, ParticleSystem *system, int steps) {
+    domain->control->params = *system;
+    domain->control->steps = steps;
+    pthread_barrier_wait(&domain->control->frameBarrier);  // workers start
+    pthread_barrier_wait(&domain->control->frameBarrier);  // workers done
+    domainGather(domain, system);
+}
+
+void domainStop(Domain *domain) {
+    domain->control->steps = -1;
+    pthread_barrier_wait(&domain->control->frameBarrier);
+    for (int w = 0; w < domain->numWorkers; w++) {
+        waitpid(domain->pids[w], NULL, 0);
+    }
+}
+#else
+typedef struct {
+    int numWorkers;
+} Domain;
+
+bool domainStart(Domain *domain, ParticleSystem *system, bool pin) {
+    fprintf(stderr, "multiple processes are not supported on this platform\n");
+    return false;
+}
+
+void domainScatter(Domain *domain, ParticleSystem *system) {}
+void domainStep(Domain *domain, ParticleSystem *system, int steps) {}
+void domainStop(Domain *domain) {}
+#endif
+
+void firstTouchJob(void *arg, int thread, int numThreads) {
+    // places each thread's slab of the per-particle buffers on its NUMA node
+    ParticleSystem *system = (ParticleSystem *) arg;
+    int start = (int) ((long long) system->n * thread / numThreads);
+    int stop = (int) ((long long) system->n * (thread + 1) / numThreads);
+    memset(system->particles + start, 0, (stop - start) * sizeof(Particle));
+    memset(system->gridMap + start, 0, (stop - start) * sizeof(int));
+    if (system->spareParticles != NULL) {
+        memset(system->spareParticles + start, 0, (stop - start) * sizeof(Particle));
+    }
+}
+
+typedef struct {
+    ParticleSystem *system;
+    int *cpu;
+    int *node;
+    int *localPages;
+    int *sampledPages;
+} PlacementReport;
+
+void placementJob(void *arg, int thread, int numThreads) {
+    PlacementReport *report = (PlacementReport *) arg;
+    ParticleSystem *system = report->system;
+    int start = (int) ((long long) system->n * thread / numThreads);
+    int stop = (int) ((long long) system->n * (thread + 1) / numThreads);
+    report->node[thread] = currentNode(&report->cpu[thread]);
+    report->localPages[thread] = countPagesOnNode(system->particles + start,
+            (stop - start) * sizeof(Particle), report->node[thread], &report->sampledPages[thread]);
+}
+
+void printPlacement(ParticleSystem *system) {
+    int numThreads = system->threads->numThreads;
+    PlacementReport report;
+    report.system = system;
+    report.cpu = malloc(numThreads * sizeof(int));
+    report.node = malloc(numThreads * sizeof(int));
+    report.localPages = malloc(numThreads * sizeof(int));
+    report.sampledPages = malloc(numThreads * sizeof(int));
+    runJob(system->threads, placementJob, &report);
+
+    for (int i = 0; i < numThreads; i++) {
+        if (report.node[i] < 0) {
+            fprintf(stderr, "thread %d: placement unknown\n", i);
+        } else if (report.sampledPages[i] == 0) {
+            fprintf(stderr, "thread %d: cpu %d, node %d\n", i, report.cpu[i], report.node[i]);
+        } else {
+            fprintf(stderr, "thread %d: cpu %d, node %d, %d%% of its particle pages local\n",
+                    i, report.cpu[i], report.node[i],
+                    100 * report.localPages[i] / report.sampledPages[i]);
+        }
+    }
+    free(report.cpu);
+    free(report.node);
+    free(report.localPages);
+    free(report.sampledPages);
+}
+
+// particle counts per cell and type, with the dominant type of each cell kept up to date
+typedef struct {
+    int w;
+    int h;
+    int m;
+    uint16_t *counts;           // w * h * m, saturating
+    uint32_t *dominant;         // per cell, see dominantKey()
+    unsigned char *dirtyRows;   // rows with particles since the last clear
+} DensityGrid;
+
+void allocDensityGrid(DensityGrid *grid, Arena *arena, int w, int h, int m) {
+    grid->w = w;
+    grid->h = h;
+    grid->m = m;
+    grid->counts = arenaAlloc(arena, (size_t) w * h * m * sizeof(uint16_t), false);
+    grid->dominant = arenaAlloc(arena, (size_t) w * h * sizeof(uint32_t), false);
+    grid->dirtyRows = arenaAlloc(arena, h, false);
+}
+
+void releaseDensityGrid(DensityGrid *grid, Arena *arena) {
+    arenaRelease(arena, grid->counts, (size_t) grid->w * grid->h * grid->m * sizeof(uint16_t));
+    arenaRelease(arena, grid->dominant, (size_t) grid->w * grid->h * sizeof(uint32_t));
+    arenaRelease(arena, grid->dirtyRows, grid->h);
+}
+
+uint32_t dominantKey(uint16_t count, int type) {
+    // larger for higher counts, and for lower types at equal counts, 0 for empty cells
+    return (uint32_t) count << 16 | (uint32_t) (0xffff - type);
+}
+
+bool projectParticle(Particle *p, int w, int h, float ratio,
+        float zoom, float shiftX, float shiftY, int *x, int *y) {
+    // the cell of a w * h grid containing a particle, for cells ratio times as high as wide
+    int w_cw = w;
+    int h_cw = h * ratio;
+
+    float x_cw = (p->x + shiftX) * zoom * h_cw / 2 + w_cw / 2;
+    float y_cw = (p->y + shiftY) * zoom * h_cw / 2 + h_cw / 2;
+
+    *x = (int) floor(x_cw);
+    *y = (int) floor(y_cw / ratio);
+
+    return *x >= 0 && *x < w && *y >= 0 && *y < h;
+}
+
+void clearDensityGrid(DensityGrid *grid) {
+    // only the rows that received particles
+    int w = grid->w;
+    int m = grid->m;
+    for (int y = 0; y < grid->h; y++) {
+        if (!grid->dirtyRows[y]) continue;
+        memset(grid->counts + (size_t) y * w * m, 0, (size_t) w * m * sizeof(uint16_t));
+        memset(grid->dominant + (size_t) y * w, 0, (size_t) w * sizeof(uint32_t));
+        grid->dirtyRows[y] = 0;
+    }
+}
+
+void countParticles(DensityGrid *grid, Particle *particles, int *map, int start, int stop,
+        float zoom, float shiftX, float shiftY) {
+    // particles map[start] to map[stop - 1], or start to stop - 1 without a map
+    int w = grid->w;
+    int h = grid->h;
+    int m = grid->m;
+    for (int k = start; k < stop; k++) {
+        Particle *p = &particles[map != NULL ? map[k] : k];
+        int x, y;
+        if (projectParticle(p, w, h, CHAR_RATIO, zoom, shiftX, shiftY, &x, &y)) {
+            int cell = y * w + x;
+            uint16_t *count = &grid->counts[cell * m + p->type];
+            if (*count < UINT16_MAX) (*count)++;
+            // a running maximum instead of a scan over the cell's counts, without branches
+            uint32_t key = dominantKey(*count, p->type);
+            uint32_t dominant = grid->dominant[cell];
+            grid->dominant[cell] = key > dominant ? key : dominant;
+            grid->dirtyRows[y] = 1;
+        }
+    }
+}
+
+void countCells(DensityGrid *grid, ParticleSystem *system, int cy, int start, int stop,
+        float zoom, float shiftX, float shiftY) {
+    // zoomed out: whole cells of the simulation, counted at their centers
+    int w = grid->w;
+    int h = grid->h;
+    int m = grid->m;
+    int gridSize = system->gridSize;
+    for (int cx = start; cx < stop; cx++) {
+        Particle center = {0, (cx + 0.5f) * 2.0f / gridSize - 1.0f, (cy + 0.5f) * 2.0f / gridSize - 1.0f, 0.0f, 0.0f};
+        int x, y;
+        if (!projectParticle(&center, w, h, CHAR_RATIO, zoom, shiftX, shiftY, &x, &y)) continue;
+        int cell = y * w + x;
+        int *types = &system->cellTypes[(cy * gridSize + cx) * m];
+        for (int type = 0; type < m; type++) {
+            if (types[type] == 0) continue;
+            uint16_t *count = &grid->counts[cell * m + type];
+            int sum = *count + types[type];
+            *count = sum < UINT16_MAX ? sum : UINT16_MAX;
+            uint32_t key = dominantKey(*count, type);
+            if (key > grid->dominant[cell]) grid->dominant[cell] = key;
+            grid->dirtyRows[y] = 1;
+        }
+    }
+}
+
+int visibleCells(float min, float max, int margin, int gridSize, int *starts, int *stops) {
+    // the cells covering [min, max) of the world, plus margin cells on each side for the particles
+    // that moved since the cells were built, wrapping around like the particles do.
+    // returns the number of ranges, at most two.
+    if (min < -1.0f) min = -1.0f;
+    if (max > 1.0f) max = 1.0f;
+    if (min >= max) return 0;
+    int first = cellCoordinate(min, gridSize) - margin;
+    int last = cellCoordinate(max, gridSize) + margin;
+    if (last - first + 1 >= gridSize) {
+        starts[0] = 0;
+        stops[0] = gridSize;
+        return 1;
+    }
+    if (first < 0) {
+        starts[0] = first + gridSize;
+        stops[0] = gridSize;
+        starts[1] = 0;
+        stops[1] = last + 1;
+        return 2;
+    }
+    if (last >= gridSize) {
+        starts[0] = first;
+        stops[0] = gridSize;
+        starts[1] = 0;
+        stops[1] = last - gridSize + 1;
+        return 2;
+    }
+    starts[0] = first;
+    stops[0] = last + 1;
+    return 1;
+}
+
+void renderDensity(DensityGrid *grid,
+        ParticleSystem *system,
+        float zoom, float shiftX, float shiftY, bool clear) {
+    if (clear) clearDensityGrid(grid);
+
+    if (!system->gridCurrent) {
+        // no cells to go by, e.g. for replays and snapshots
+        countParticles(grid, system->particles, NULL, 0, system->n, zoom, shiftX, shiftY);
+        return;
+    }
+
+    // the world coordinates shown, inverting projectParticle()
+    int w_cw = grid->w;
+    int h_cw = grid->h * CHAR_RATIO;
+    float scale = zoom * h_cw / 2;
+    int numX, numY;
+    int startX[2], stopX[2], startY[2], stopY[2];
+    int gridSize = system->gridSize;
+    float cellSize = 2.0f / gridSize;
+    // fast particles or long time steps can cross several cells in one move
+    int margin = system->maxMove < 2.0f ? 1 + (int) (system->maxMove / cellSize) : gridSize;
+    numX = visibleCells((0 - w_cw / 2) / scale - shiftX, (w_cw - w_cw / 2) / scale - shiftX,
+            margin, gridSize, startX, stopX);
+    numY = visibleCells((0 - h_cw / 2) / scale - shiftY, (grid->h * CHAR_RATIO - h_cw / 2) / scale - shiftY,
+            margin, gridSize, startY, stopY);
+
+    // the particles in view, from the cell starts
+    int *cells = system->grid;
+    int numCells = 0;
+    int numParticles = 0;
+    for (int j = 0; j < numY; j++) {
+        for (int i = 0; i < numX; i++) {
+            numCells += (stopY[j] - startY[j]) * (stopX[i] - startX[i]);
+            for (int cy = startY[j]; cy < stopY[j]; cy++) {
+                numParticles += cells[cy * gridSize + stopX[i]] - cells[cy * gridSize + startX[i]];
+            }
+        }
+    }
+    // when several cells fit into one character, count whole cells if they are fewer than the particles
+    bool wholeCells = cellSize * scale <= 0.5f && numCells * grid->m < numParticles;
+    if (wholeCells != system->cellTypesWanted) {
+        // the next buildGrid() starts or stops counting the types per cell
+        if (wholeCells) reserveCellTypes(system);
+        system->cellTypesWanted = wholeCells;
+    }
+    if (!system->cellTypesCurrent) wholeCells = false;
+    if (!wholeCells && numParticles > system->n / 2) {
+        // most of them, in memory order is faster
+        countParticles(grid, system->particles, NULL, 0, system->n, zoom, shiftX, shiftY);
+        return;
+    }
+    for (int j = 0; j < numY; j++) {
+        for (int cy = startY[j]; cy < stopY[j]; cy++) {
+            for (int i = 0; i < numX; i++) {
+                if (wholeCells) {
+                    countCells(grid, system, cy, startX[i], stopX[i], zoom, shiftX, shiftY);
+                } else {
+                    // the cells of a row are consecutive in gridMap
+                    countParticles(grid, system->particles, system->gridMap,
+                            cells[cy * gridSize + startX[i]], cells[cy * gridSize + stopX[i]],
+                            zoom, shiftX, shiftY);
                 }
-                putchar(c);
             }
         }
-        if (colorMode == 1) {
-            printf("\033[0m"); // reset ANSI color code
+    }
+}
+
+// set by SIGINT and SIGTERM without the GUI, ends the main loop
+volatile sig_atomic_t quitRequested = 0;
+
+void requestQuit(int sig) {
+    (void) sig;
+    quitRequested = 1;
+}
+
+bool writeAll(int fd, const char *data, size_t size) {
+    // a pipe may take only part of the data
+    while (size > 0) {
+        ssize_t written = write(fd, data, size);
+        if (written < 0 && errno == EINTR) continue;
+        if (written <= 0) return false;  // EPIPE: the reader went away
+        data += written;
+        size -= (size_t) written;
+    }
+    return true;
+}
+
+char *putColor(char *out, int color) {
+    // the ANSI escape for a 256 color foreground, without printf
+    memcpy(out, "\033[38;5;", 7);
+    out += 7;
+    char digits[12];
+    int numDigits = 0;
+    do {
+        digits[numDigits++] = (char) ('0' + color % 10);
+        color /= 10;
+    } while (color > 0);
+    while (numDigits > 0) *out++ = digits[--numDigits];
+    *out++ = 'm';
+    return out;
+}
+
+uint32_t textCell(char c, int color) {
+    // blanks look the same in any color, the color is an index of the 256 color palette
+    return c == ' ' ? ' ' : (uint32_t) color << 8 | (unsigned char) c;
+}
+
+char *putCell(char *out, uint32_t cell, int *color) {
+    // a color escape only when the color changes
+    int cellColor = (int) (cell >> 8);
+    if (cell != ' ' && cellColor != *color) {
+        if (cellColor == 0) {
+            memcpy(out, "\033[0m", 4);
+            out += 4;
+        } else {
+            out = putColor(out, cellColor);
         }
-        putchar('\n');
+        *color = cellColor;
     }
+    *out++ = (char) (cell & 0xff);
+    return out;
 }
 
-void renderTerminal(ParticleSystem *system, UiSettings *ui, WINDOW *win, int *densityGridBuf) {
-    int w = ui->w;
-    int h = ui->h;
-    int colorMode = ui->colorMode;
-    int m = system->m;
-    char *densityChars = ui->densityChars;
-    size_t densityCharsLen = strlen(densityChars);
+char *putFullFrame(char *out, uint32_t *cells, int w, int h) {
+    for (int y = 0; y < h; y++) {
+        int color = 0;  // the terminal's default
+        for (int x = 0; x < w; x++) {
+            out = putCell(out, cells[y * w + x], &color);
+        }
+        if (color != 0) {
+            memcpy(out, "\033[0m", 4); // reset ANSI color code
+            out += 4;
+        }
+        *out++ = '\n';
+    }
+    return out;
+}
 
-    // draw grid
-    chtype rowString[w];
+char *putDiffFrame(char *out, uint32_t *cells, uint32_t *previous, int w, int h) {
+    // redraws the changed cells of the frame above the cursor, moving the cursor relative to it
+    int cursorX = 0;
+    int cursorY = h;  // on the line below the frame
+    int color = 0;
     for (int y = 0; y < h; y++) {
         for (int x = 0; x < w; x++) {
-            // find most common particle type
-            int maxType = 0;
-            int maxCount = 0;
-            int offset = y * w * m + x * m;
-            for (int i = 0; i < m; i++) {
-                int count = densityGridBuf[offset + i];
-                if (count > maxCount) {
-                    maxType = i;
-                    maxCount = count;
+            if (cells[y * w + x] == previous[y * w + x]) continue;
+            if (cursorY == y && cursorX >= 0 && cursorX < x && x - cursorX <= TEXT_MAX_REDRAWN_GAP) {
+                // reprinting a few unchanged cells is shorter than moving over them
+                while (cursorX < x) out = putCell(out, cells[y * w + cursorX++], &color);
+            } else {
+                if (cursorY != y) {
+                    out += sprintf(out, "\033[%d%c", abs(cursorY - y), cursorY > y ? 'A' : 'B');
+                    cursorY = y;
+                }
+                if (cursorX != x) {
+                    out += sprintf(out, "\033[%dG", x + 1);
                 }
             }
+            out = putCell(out, cells[y * w + x], &color);
+            // after the last column, the position depends on the terminal's line wrapping
+            cursorX = (x + 1 < w) ? x + 1 : -1;
+        }
+    }
+    if (color != 0) {
+        memcpy(out, "\033[0m", 4);
+        out += 4;
+    }
+    if (cursorY != h) {
+        out += sprintf(out, "\033[%dB", h - cursorY);
+    }
+    if (cursorX != 0) *out++ = '\r';
+    return out;
+}
+
+void densityCells(UiSettings *ui, DensityGrid *grid, uint32_t *cells, bool color) {
+    // the character and color of each cell, see textCell()
+    int w = grid->w;
+    int h = grid->h;
+    char *densityChars = ui->densityChars;
+    size_t densityCharsLen = strlen(densityChars);
+    for (int y = 0; y < h; y++) {
+        for (int x = 0; x < w; x++) {
+            // most common particle type, found by renderDensity()
+            uint32_t dominant = grid->dominant[y * w + x];
+            int maxType = 0xffff - (int) (dominant & 0xffff);
+            int maxCount = (int) (dominant >> 16);
             // draw character
-            if (maxCount == 0) {
-                rowString[x] = ' ';
-            } else {
+            char c = ' ';
+            if (maxCount > 0) {
+                size_t index = (size_t) maxCount - 1;
+                if (index > densityCharsLen - 1) {
+                    index = densityCharsLen - 1;
+                }
+                c = densityChars[index];
+            }
+            cells[y * w + x] = textCell(c, color ? maxType + 1 : 0);
+        }
+    }
+}
+
+bool renderText(UiSettings *ui, DensityGrid *grid) {
+    // builds the whole frame in memory and prints it with a single write(),
+    // with -O only the changed cells unless that is longer
+    int w = grid->w;
+    int h = grid->h;
+    TextOutput *text = &ui->text;
+
+    if (text->w != w || text->h != h) {
+        // cursor movement, then per cell at most two escapes and a character, per row a reset
+        free(text->full);
+        free(text->diff);
+        free(text->cells);
+        free(text->previous);
+        text->full = malloc(16 + (size_t) h * ((size_t) w * 16 + 5));
+        text->diff = malloc(32 + (size_t) h * (size_t) w * 32);
+        text->cells = malloc((size_t) w * h * sizeof(uint32_t));
+        text->previous = malloc((size_t) w * h * sizeof(uint32_t));
+        text->w = w;
+        text->h = h;
+        ui->printInPlaceIsFirstFrame = true;
+    }
+
+    densityCells(ui, grid, text->cells, ui->colorMode == 1);
+
+    char *out = text->full;
+    if (ui->printInPlace && !ui->printInPlaceIsFirstFrame) {
+        // move cursor up
+        out += sprintf(out, "\033[%dA", h);
+    }
+    out = putFullFrame(out, text->cells, w, h);
+    char *frame = text->full;
+    size_t size = (size_t) (out - text->full);
+    size_t fullSize = size;
+
+    if (ui->printInPlace) {
+        if (ui->printInPlaceIsFirstFrame) {
+            ui->printInPlaceIsFirstFrame = false;
+        } else {
+            char *end = putDiffFrame(text->diff, text->cells, text->previous, w, h);
+            if ((size_t) (end - text->diff) < size) {
+                frame = text->diff;
+                size = (size_t) (end - text->diff);
+            }
+        }
+        uint32_t *previous = text->previous;
+        text->previous = text->cells;
+        text->cells = previous;
+    }
+
+    fflush(stdout);
+    if (!writeAll(STDOUT_FILENO, frame, size)) return false;
+    text->frames++;
+    text->bytes += size;
+    text->fullBytes += fullSize;
+    return true;
+}
+
+// header of each --raw-frames frame, followed by the counts of the DensityGrid (h rows of w cells of m colors)
+typedef struct {
+    char magic[4];              // RAW_FRAME_MAGIC
+    uint32_t w;
+    uint32_t h;
+    uint32_t m;
+    uint64_t frame;             // frames written before this one
+} RawFrameHeader;
+
+void swapBytes32(uint32_t *values, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        uint32_t v = values[i];
+        values[i] = (v >> 24) | ((v >> 8) & 0xff00) | ((v << 8) & 0xff0000) | (v << 24);
+    }
+}
+
+void swapBytes16(uint16_t *values, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        values[i] = (uint16_t) ((values[i] >> 8) | (values[i] << 8));
+    }
+}
+
+bool writeRawFrame(UiSettings *ui, DensityGrid *grid, uint64_t frame) {
+    // the density counts go out unchanged, with one write() per frame
+    RawFrameHeader header;
+    memcpy(header.magic, RAW_FRAME_MAGIC, sizeof(header.magic));
+    header.w = grid->w;
+    header.h = grid->h;
+    header.m = grid->m;
+    header.frame = frame;
+    size_t count = (size_t) grid->w * grid->h * grid->m;
+    uint32_t probe = 1;
+    bool bigEndian = *(unsigned char *) &probe == 0;
+    if (bigEndian) {
+        swapBytes32(&header.w, 3);
+        uint32_t *halves = (uint32_t *) &header.frame;
+        uint32_t high = halves[0];
+        halves[0] = halves[1];
+        halves[1] = high;
+        swapBytes32(halves, 2);
+        swapBytes16(grid->counts, count);
+    }
+    const char *data[2] = {(const char *) &header, (const char *) grid->counts};
+    size_t left[2] = {sizeof(header), count * sizeof(uint16_t)};
+    bool ok = true;
+#ifdef __unix__
+    while (ok && left[0] + left[1] > 0) {
+        struct iovec parts[2] = {{(void *) data[0], left[0]}, {(void *) data[1], left[1]}};
+        ssize_t written = writev(STDOUT_FILENO, left[0] > 0 ? parts : parts + 1, left[0] > 0 ? 2 : 1);
+        if (written < 0 && errno == EINTR) continue;
+        if (written <= 0) {
+            // EPIPE: the reader went away
+            ok = false;
+            break;
+        }
+        // a pipe may take only part of the frame
+        for (int i = 0; i < 2; i++) {
+            size_t taken = (size_t) written < left[i] ? (size_t) written : left[i];
+            data[i] += taken;
+            left[i] -= taken;
+            written -= (ssize_t) taken;
+        }
+    }
+#else
+    ok = fwrite(data[0], 1, left[0], stdout) == left[0]
+            && fwrite(data[1], 1, left[1], stdout) == left[1]
+            && fflush(stdout) == 0;
+#endif
+    // without -d, the buffer is cleared before the next frame anyway
+    if (bigEndian && !ui->clear) swapBytes16(grid->counts, count);
+    return ok;
+}
+
+void renderTerminal(UiSettings *ui, WINDOW *win, DensityGrid *grid) {
+    int w = grid->w;
+    int h = grid->h;
+    int colorMode = ui->colorMode;
+    char *densityChars = ui->densityChars;
+    size_t densityCharsLen = strlen(densityChars);
+
+    // draw grid
+    chtype rowString[w];
+    for (int y = 0; y < h; y++) {
+        for (int x = 0; x < w; x++) {
+            // most common particle type, found by renderDensity()
+            uint32_t dominant = grid->dominant[y * w + x];
+            int maxType = 0xffff - (int) (dominant & 0xffff);
+            int maxCount = (int) (dominant >> 16);
+            // draw character
+            if (maxCount == 0) {
+                rowString[x] = ' ';
+            } else {
                 size_t index = (size_t) maxCount - 1;
                 if (index > densityCharsLen - 1) {
                     index = densityCharsLen - 1;
@@ -390,82 +2444,2932 @@ void renderTerminal(ParticleSystem *system, UiSettings *ui, WINDOW *win, int *de
     }
 }
 
+// the GUI drawn by writing escape sequences to the terminal, curses only reads the keyboard
+typedef struct {
+    uint32_t *cells;            // the frame being composed, see textCell() and SCREEN_REVERSE
+    uint32_t *screen;           // cells on the terminal
+    char *out;
+    int w;
+    int h;
+    bool valid;                 // the terminal shows the screen cells
+} DirectScreen;
+
+void startDirectScreen(DirectScreen *direct, int w, int h) {
+    direct->w = w;
+    direct->h = h;
+    direct->cells = malloc((size_t) w * h * sizeof(uint32_t));
+    direct->screen = malloc((size_t) w * h * sizeof(uint32_t));
+    // synchronized update, cursor moves, attributes and a character per cell
+    direct->out = malloc(64 + (size_t) w * h * 48);
+    direct->valid = false;
+}
+
+void overlayWindow(DirectScreen *direct, WINDOW *win) {
+    // copies a curses window into the frame at its position on the screen,
+    // so that the info texts stay curses code
+    int top, left, rows, cols;
+    getbegyx(win, top, left);
+    getmaxyx(win, rows, cols);
+    chtype line[cols + 1];
+    for (int y = 0; y < rows && top + y < direct->h; y++) {
+        mvwinchnstr(win, y, 0, line, cols);
+        for (int x = 0; x < cols && left + x < direct->w; x++) {
+            chtype ch = line[x];
+            uint32_t cell = (uint32_t) PAIR_NUMBER(ch & A_COLOR) << 8 | (unsigned char) (ch & A_CHARTEXT);
+            if (ch & A_REVERSE) cell |= SCREEN_REVERSE;
+            if (ch & A_ALTCHARSET) cell |= SCREEN_LINE_DRAWING;
+            direct->cells[(top + y) * direct->w + left + x] = cell;
+        }
+    }
+}
+
+void overlayString(DirectScreen *direct, int y, int x, const char *string) {
+    for (; *string != '\0' && x < direct->w; string++, x++) {
+        if (y >= 0 && y < direct->h && x >= 0) direct->cells[y * direct->w + x] = (unsigned char) *string;
+    }
+}
+
+char *putScreenCell(char *out, uint32_t cell, uint32_t *attributes) {
+    // attributes are only switched for cells where they are visible
+    uint32_t cellAttributes = cell & ~0xffu;
+    bool blank = (cell & 0xff) == ' ' && !(cellAttributes & SCREEN_REVERSE) && !(*attributes & SCREEN_REVERSE);
+    if (!blank && cellAttributes != *attributes) {
+        if ((cellAttributes ^ *attributes) & SCREEN_LINE_DRAWING) {
+            memcpy(out, (cellAttributes & SCREEN_LINE_DRAWING) ? "\033(0" : "\033(B", 3);
+            out += 3;
+        }
+        if ((cellAttributes ^ *attributes) & ~SCREEN_LINE_DRAWING) {
+            memcpy(out, "\033[0m", 4);
+            out += 4;
+            if (cellAttributes & SCREEN_REVERSE) {
+                memcpy(out, "\033[7m", 4);
+                out += 4;
+            }
+            int color = (int) ((cell >> 8) & 0xffff);
+            if (color != 0) out = putColor(out, color);
+        }
+        *attributes = cellAttributes;
+    }
+    *out++ = (char) (cell & 0xff);
+    return out;
+}
+
+bool flushDirectScreen(DirectScreen *direct) {
+    // writes the changed cells with a single write(), as one synchronized update
+    int w = direct->w;
+    int h = direct->h;
+    char *out = direct->out;
+    memcpy(out, "\033[?2026h", 8);
+    out += 8;
+    char *changes = out;
+    uint32_t attributes = 0;
+    int cursorX = -1;
+    int cursorY = -1;
+    for (int y = 0; y < h; y++) {
+        for (int x = 0; x < w; x++) {
+            uint32_t cell = direct->cells[y * w + x];
+            if (direct->valid && cell == direct->screen[y * w + x]) continue;
+            if (cursorY == y && cursorX >= 0 && cursorX < x && x - cursorX <= TEXT_MAX_REDRAWN_GAP) {
+                // reprinting a few unchanged cells is shorter than moving over them
+                while (cursorX < x) {
+                    out = putScreenCell(out, direct->cells[y * w + cursorX], &attributes);
+                    cursorX++;
+                }
+            } else if (cursorY != y || cursorX != x) {
+                out += sprintf(out, "\033[%d;%dH", y + 1, x + 1);
+            }
+            out = putScreenCell(out, cell, &attributes);
+            cursorX = (x + 1 < w) ? x + 1 : -1;
+            cursorY = y;
+        }
+    }
+    if (out == changes) return true;
+    if (attributes & SCREEN_LINE_DRAWING) {
+        memcpy(out, "\033(B", 3);
+        out += 3;
+    }
+    // curses expects the default attributes and the cursor in the corner
+    memcpy(out, "\033[0m\033[H\033[?2026l", 15);
+    out += 15;
+
+    uint32_t *screen = direct->screen;
+    direct->screen = direct->cells;
+    direct->cells = screen;
+    direct->valid = true;
+    return writeAll(STDOUT_FILENO, direct->out, (size_t) (out - direct->out));
+}
+
+void stopDirectScreen(DirectScreen *direct) {
+    free(direct->cells);
+    free(direct->screen);
+    free(direct->out);
+}
+
+
+
+void expandBlockMatrix(ParticleSystem *system) {
+    int m = system->m;
+    int f = system->numFamilies;
+    for (int i = 0; i < m; i++) {
+        for (int j = 0; j < m; j++) {
+            system->matrix[i * m + j] = system->blockMatrix[system->family[i] * f + system->family[j]];
+        }
+    }
+}
+
+void expandLowRankMatrix(ParticleSystem *system) {
+    int m = system->m;
+    int r = system->rank;
+    for (int i = 0; i < m; i++) {
+        for (int j = 0; j < m; j++) {
+            float a = 0.0f;
+            for (int k = 0; k < r; k++) {
+                a += system->factorU[i * r + k] * system->factorV[j * r + k];
+            }
+            system->matrix[i * m + j] = a;
+        }
+    }
+}
+
+void averageBlocks(ParticleSystem *system) {
+    // approximate the dense matrix by the mean value of each family block
+    int m = system->m;
+    int f = system->numFamilies;
+    // on the heap, large numbers of families would overflow the stack
+    int *count = calloc((size_t) f * f, sizeof(int));
+    for (int b = 0; b < f * f; b++) {
+        system->blockMatrix[b] = 0.0f;
+    }
+    for (int i = 0; i < m; i++) {
+        for (int j = 0; j < m; j++) {
+            int b = system->family[i] * f + system->family[j];
+            system->blockMatrix[b] += system->matrix[i * m + j];
+            count[b]++;
+        }
+    }
+    for (int b = 0; b < f * f; b++) {
+        if (count[b] > 0) system->blockMatrix[b] /= (float) count[b];
+    }
+    free(count);
+}
+
+void factorizeLowRank(ParticleSystem *system) {
+    // truncated factorization via power iteration with deflation
+    int m = system->m;
+    int r = system->rank;
+    float *residual = malloc(m * m * sizeof(float));
+    memcpy(residual, system->matrix, m * m * sizeof(float));
+    float *u = malloc(m * sizeof(float));
+    float *v = malloc(m * sizeof(float));
+
+    for (int k = 0; k < r; k++) {
+        // deterministic start vector, so that seeded runs stay reproducible
+        for (int j = 0; j < m; j++) {
+            v[j] = ((j + k) % 2 == 0) ? 1.0f : 0.5f;
+        }
+        float sigma = 0.0f;
+        for (int iter = 0; iter < LOW_RANK_ITERATIONS; iter++) {
+            // u = R v / |R v|
+            float norm = 0.0f;
+            for (int i = 0; i < m; i++) {
+                float sum = 0.0f;
+                for (int j = 0; j < m; j++) {
+                    sum += residual[i * m + j] * v[j];
+                }
+                u[i] = sum;
+                norm += sum * sum;
+            }
+            norm = sqrtf(norm);
+            if (norm == 0.0f) break;
+            for (int i = 0; i < m; i++) u[i] /= norm;
+            // v = R^T u / sigma
+            sigma = 0.0f;
+            for (int j = 0; j < m; j++) v[j] = 0.0f;
+            for (int i = 0; i < m; i++) {
+                for (int j = 0; j < m; j++) {
+                    v[j] += residual[i * m + j] * u[i];
+                }
+            }
+            for (int j = 0; j < m; j++) sigma += v[j] * v[j];
+            sigma = sqrtf(sigma);
+            if (sigma == 0.0f) break;
+            for (int j = 0; j < m; j++) v[j] /= sigma;
+        }
+        float s = sqrtf(sigma);
+        for (int i = 0; i < m; i++) {
+            system->factorU[i * r + k] = (sigma > 0.0f) ? u[i] * s : 0.0f;
+            system->factorV[i * r + k] = (sigma > 0.0f) ? v[i] * s : 0.0f;
+        }
+        for (int i = 0; i < m; i++) {
+            for (int j = 0; j < m; j++) {
+                residual[i * m + j] -= system->factorU[i * r + k] * system->factorV[j * r + k];
+            }
+        }
+    }
+    free(residual);
+    free(u);
+    free(v);
+}
+
+void quantizeMatrix(ParticleSystem *system) {
+    int mm = system->m * system->m;
+    float maxAbs = 0.0f;
+    for (int i = 0; i < mm; i++) {
+        if (fabsf(system->matrix[i]) > maxAbs) maxAbs = fabsf(system->matrix[i]);
+    }
+    system->quantScale = (maxAbs > 0.0f) ? maxAbs / 127.0f : 1.0f;
+    for (int i = 0; i < mm; i++) {
+        system->quantMatrix[i] = (signed char) lroundf(system->matrix[i] / system->quantScale);
+    }
+}
+
+void compressMatrix(ParticleSystem *system, int nativeFormat) {
+    // derive the representation used by update() from the dense matrix,
+    // unless the generator already produced it exactly ("nativeFormat")
+    int format = system->matrixFormat;
+    if (format == MATRIX_FORMAT_AUTO) format = nativeFormat;
+    system->activeMatrixFormat = format;
+    if (format == nativeFormat) return;
+
+    switch (format) {
+        case MATRIX_FORMAT_BLOCK:
+            averageBlocks(system);
+            break;
+        case MATRIX_FORMAT_LOW_RANK:
+            factorizeLowRank(system);
+            break;
+        case MATRIX_FORMAT_QUANTIZED:
+            quantizeMatrix(system);
+            break;
+        default:
+            break;
+    }
+}
+
+typedef struct {
+    ParticleSystem *system;
+    int mode;
+    uint64_t seed;  // drawn from system->rng, one stream per block
+} RandomJob;
+
+void blockRange(int count, int blockSize, int thread, int numThreads, int *start, int *stop) {
+    // the blocks of [0, count) handled by a thread
+    int numBlocks = (count + blockSize - 1) / blockSize;
+    *start = (int) ((long long) numBlocks * thread / numThreads);
+    *stop = (int) ((long long) numBlocks * (thread + 1) / numThreads);
+}
+
+void randomRowsJob(void *arg, int thread, int numThreads) {
+    RandomJob *job = (RandomJob *) arg;
+    ParticleSystem *system = job->system;
+    int start, stop;
+    blockRange(system->m, 1, thread, numThreads, &start, &stop);
+    for (int i = start; i < stop; i++) {
+        Rng rng;
+        rngSeed(&rng, job->seed, i);
+        for (int j = 0; j < system->m; j++) {
+            system->matrix[i * system->m + j] = rngFloat(&rng) * 2.0f - 1.0f;
+        }
+    }
+}
+
+void randomizeMatrix(ParticleSystem *system, int mode) {
+    if (mode < 1 || mode > NUM_MATRIX_MODES) return;
+
+    int nativeFormat = MATRIX_FORMAT_DENSE;
+    if (mode == 1) {
+        RandomJob job = {system, mode, rngNext(&system->rng)};
+        runJob(system->threads, randomRowsJob, &job);
+    } else if (mode == 2) {
+        for (int i = 0; i < system->m; i++) {
+            for (int j = 0; j < system->m; j++) {
+                float val = 0.0f;
+                if (i == j) {
+                    val = 1.0f;
+                }
+                if (i == (j + 1) % system->m) {
+                    val = 0.5f;
+                }
+                system->matrix[i * system->m + j] = val;
+            }
+        }
+    } else if (mode == 3) {
+        int f = system->numFamilies;
+        for (int b = 0; b < f * f; b++) {
+            system->blockMatrix[b] = rngFloat(&system->rng) * 2.0f - 1.0f;
+        }
+        expandBlockMatrix(system);
+        nativeFormat = MATRIX_FORMAT_BLOCK;
+    } else if (mode == 4) {
+        // scaled so that the entries have a standard deviation of about 0.5
+        float scale = powf(2.25f / (float) system->rank, 0.25f);
+        for (int i = 0; i < system->m * system->rank; i++) {
+            system->factorU[i] = (rngFloat(&system->rng) * 2.0f - 1.0f) * scale;
+            system->factorV[i] = (rngFloat(&system->rng) * 2.0f - 1.0f) * scale;
+        }
+        expandLowRankMatrix(system);
+        nativeFormat = MATRIX_FORMAT_LOW_RANK;
+    }
+    compressMatrix(system, nativeFormat);
+}
+
+void initPosition(Particle *particle, int mode, Rng *rng) {
+    if (mode == 1) {
+        particle->x = rngFloat(rng) * 2.0f - 1.0f;
+        particle->y = rngFloat(rng) * 2.0f - 1.0f;
+    } else if (mode == 2) {
+        // random direction by rejection, avoids platform dependent sin / cos
+        float dx, dy, len2;
+        do {
+            dx = rngFloat(rng) * 2.0f - 1.0f;
+            dy = rngFloat(rng) * 2.0f - 1.0f;
+            len2 = dx * dx + dy * dy;
+        } while (len2 > 1.0f || len2 == 0.0f);
+        float len = sqrtf(len2);
+        float radius = rngFloat(rng) * rngFloat(rng) * 0.3f;
+        particle->x = dx / len * radius;
+        particle->y = dy / len * radius;
+    } else if (mode == 3) {
+        particle->x = rngFloat(rng) * 2.0f - 1.0f;
+        particle->y = (rngFloat(rng) - 0.5f) * 0.2f * rngFloat(rng);
+    } else if (mode == 4) {
+        float angle = rngFloat(rng) * 2.0f * M_PI;
+        float radius = 0.1f + angle * 0.1f;
+        particle->x = cosf(angle) * radius;
+        particle->y = sinf(angle) * radius;
+    }
+}
+
+void initPositionsJob(void *arg, int thread, int numThreads) {
+    RandomJob *job = (RandomJob *) arg;
+    ParticleSystem *system = job->system;
+    int start, stop;
+    blockRange(system->n, RNG_BLOCK_SIZE, thread, numThreads, &start, &stop);
+    for (int b = start; b < stop; b++) {
+        Rng rng;
+        rngSeed(&rng, job->seed, b);
+        int end = (b + 1) * RNG_BLOCK_SIZE < system->n ? (b + 1) * RNG_BLOCK_SIZE : system->n;
+        for (int i = b * RNG_BLOCK_SIZE; i < end; i++) {
+            initPosition(&system->particles[i], job->mode, &rng);
+        }
+    }
+}
+
+void initPositions(ParticleSystem *system, int mode) {
+    if (mode < 1 || mode > NUM_POSITION_MODES) return;
+    RandomJob job = {system, mode, rngNext(&system->rng)};
+    runJob(system->threads, initPositionsJob, &job);
+    system->gridCurrent = false;
+}
+
+void initTypesJob(void *arg, int thread, int numThreads) {
+    RandomJob *job = (RandomJob *) arg;
+    ParticleSystem *system = job->system;
+    int start, stop;
+    blockRange(system->n, RNG_BLOCK_SIZE, thread, numThreads, &start, &stop);
+    for (int b = start; b < stop; b++) {
+        Rng rng;
+        rngSeed(&rng, job->seed, b);
+        int end = (b + 1) * RNG_BLOCK_SIZE < system->n ? (b + 1) * RNG_BLOCK_SIZE : system->n;
+        for (int i = b * RNG_BLOCK_SIZE; i < end; i++) {
+            Particle *particle = &system->particles[i];
+            particle->type = rngBelow(&rng, system->m);
+            particle->vx = 0.0f;
+            particle->vy = 0.0f;
+        }
+    }
+}
+
+void initTypes(ParticleSystem *system) {
+    // random types, resting particles
+    RandomJob job = {system, 0, rngNext(&system->rng)};
+    runJob(system->threads, initTypesJob, &job);
+    system->gridCurrent = false;
+}
+
+void resizeParticleBuffers(ParticleSystem *system, int capacity) {
+    // the per-particle buffers besides "particles", all rebuilt by every update()
+    Arena *arena = system->arena;
+    arenaRelease(arena, system->gridMap, system->capacity * sizeof(int));
+    system->gridMap = arenaAlloc(arena, capacity * sizeof(int), false);
+    if (system->spareParticles != NULL) {
+        arenaRelease(arena, system->spareParticles, system->capacity * sizeof(Particle));
+        system->spareParticles = arenaAlloc(arena, capacity * sizeof(Particle), false);
+    }
+    if (system->ghostParticles != NULL) {
+        arenaRelease(arena, system->ghostParticles, 4 * system->capacity * sizeof(Particle));
+        system->ghostParticles = arenaAlloc(arena, 4 * capacity * sizeof(Particle), false);
+    }
+    system->capacity = capacity;
+}
+
+void reserveParticles(ParticleSystem *system, int n) {
+    // grows all per-particle buffers, call outside of update()
+    if (n <= system->capacity) return;
+    int capacity = (n > 2 * system->capacity) ? n : 2 * system->capacity;
+    Particle *particles = arenaAlloc(system->arena, capacity * sizeof(Particle), false);
+    memcpy(particles, system->particles, system->n * sizeof(Particle));
+    arenaRelease(system->arena, system->particles, system->capacity * sizeof(Particle));
+    system->particles = particles;
+    resizeParticleBuffers(system, capacity);
+}
+
+int addParticle(ParticleSystem *system, int type, float x, float y) {
+    // O(1) unless the pool has to grow, returns the index of the new particle
+    reserveParticles(system, system->n + 1);
+    Particle *particle = &system->particles[system->n];
+    particle->type = type;
+    particle->x = x;
+    particle->y = y;
+    particle->vx = 0.0f;
+    particle->vy = 0.0f;
+    system->gridCurrent = false;
+    return system->n++;
+}
+
+void removeParticle(ParticleSystem *system, int i) {
+    // O(1), the last particle takes over index i
+    system->n--;
+    system->particles[i] = system->particles[system->n];
+    system->layoutVersion++;
+    system->gridCurrent = false;
+}
+
+void setParticleCount(ParticleSystem *system, int n, int positionMode) {
+    // removes random particles or adds new ones with random types
+    while (system->n > n) {
+        removeParticle(system, rngBelow(&system->rng, system->n));
+    }
+    reserveParticles(system, n);
+    while (system->n < n) {
+        int i = addParticle(system, rngBelow(&system->rng, system->m), 0.0f, 0.0f);
+        initPosition(&system->particles[i], positionMode, &system->rng);
+    }
+}
+
+void reserveTypes(ParticleSystem *system, int m) {
+    // grows all matrix buffers, keeping the dense matrix, call outside of update()
+    if (m <= system->typeCapacity) return;
+    int capacity = (m > 2 * system->typeCapacity) ? m : 2 * system->typeCapacity;
+    int oldCapacity = system->typeCapacity;
+    Arena *arena = system->arena;
+    float *matrix = arenaAlloc(arena, capacity * capacity * sizeof(float), false);
+    memcpy(matrix, system->matrix, system->m * system->m * sizeof(float));
+    arenaRelease(arena, system->matrix, oldCapacity * oldCapacity * sizeof(float));
+    system->matrix = matrix;
+    // the other formats are derived from the dense matrix again
+    arenaRelease(arena, system->family, oldCapacity * sizeof(int));
+    system->family = arenaAlloc(arena, capacity * sizeof(int), false);
+    arenaRelease(arena, system->blockMatrix, oldCapacity * oldCapacity * sizeof(float));
+    system->blockMatrix = arenaAlloc(arena, capacity * capacity * sizeof(float), false);
+    arenaRelease(arena, system->factorU, oldCapacity * system->rank * sizeof(float));
+    system->factorU = arenaAlloc(arena, capacity * system->rank * sizeof(float), false);
+    arenaRelease(arena, system->factorV, oldCapacity * system->rank * sizeof(float));
+    system->factorV = arenaAlloc(arena, capacity * system->rank * sizeof(float), false);
+    arenaRelease(arena, system->quantMatrix, oldCapacity * oldCapacity * sizeof(signed char));
+    system->quantMatrix = arenaAlloc(arena, capacity * capacity * sizeof(signed char), false);
+    system->typeCapacity = capacity;
+}
+
+void setTypeCount(ParticleSystem *system, int m) {
+    // keeps the coefficients between the remaining types, new ones are random
+    int oldM = system->m;
+    reserveTypes(system, m);
+    float *matrix = system->matrix;
+    if (m > oldM) {
+        // restride in place, starting at the back so that no row is overwritten before it moved
+        for (int i = oldM - 1; i >= 0; i--) {
+            for (int j = oldM - 1; j >= 0; j--) {
+                matrix[i * m + j] = matrix[i * oldM + j];
+            }
+        }
+        for (int i = 0; i < m; i++) {
+            for (int j = (i < oldM) ? oldM : 0; j < m; j++) {
+                matrix[i * m + j] = rngFloat(&system->rng) * 2.0f - 1.0f;
+            }
+        }
+    } else {
+        for (int i = 0; i < m; i++) {
+            for (int j = 0; j < m; j++) {
+                matrix[i * m + j] = matrix[i * oldM + j];
+            }
+        }
+    }
+    system->m = m;
+
+    if (system->numFamilies > m) system->numFamilies = m;
+    if (system->rank > m) system->rank = m;
+    for (int i = 0; i < m; i++) {
+        system->family[i] = i * system->numFamilies / m;
+    }
+    // a structure chosen automatically is kept, the matrix is projected onto it for the new types
+    int nativeFormat = MATRIX_FORMAT_DENSE;
+    if (system->matrixFormat == MATRIX_FORMAT_AUTO && system->activeMatrixFormat == MATRIX_FORMAT_BLOCK) {
+        averageBlocks(system);
+        expandBlockMatrix(system);
+        nativeFormat = MATRIX_FORMAT_BLOCK;
+    } else if (system->matrixFormat == MATRIX_FORMAT_AUTO && system->activeMatrixFormat == MATRIX_FORMAT_LOW_RANK) {
+        factorizeLowRank(system);
+        expandLowRankMatrix(system);
+        nativeFormat = MATRIX_FORMAT_LOW_RANK;
+    }
+    compressMatrix(system, nativeFormat);
+
+    for (int i = 0; i < system->n; i++) {
+        if (system->particles[i].type >= m) {
+            system->particles[i].type = rngBelow(&system->rng, m);
+        }
+    }
+    if (system->cellTypesWanted) reserveCellTypes(system);
+    system->cellTypesCurrent = false;
+    system->layoutVersion++;
+}
+
+bool hasSuffix(const char *str, const char *suffix) {
+    size_t len = strlen(str);
+    size_t suffixLen = strlen(suffix);
+    return len >= suffixLen && strcmp(str + len - suffixLen, suffix) == 0;
+}
+
+bool saveParticleFile(ParticleSystem *system, const char *path) {
+    // one particle per line: x y vx vy type
+    FILE *file = fopen(path, "w");
+    if (file == NULL) {
+        fprintf(stderr, "could not write %s\n", path);
+        return false;
+    }
+    for (int i = 0; i < system->n; i++) {
+        Particle *p = &system->particles[i];
+        fprintf(file, "%.9g %.9g %.9g %.9g %d\n", p->x, p->y, p->vx, p->vy, p->type);
+    }
+    return fclose(file) == 0;
+}
+
+bool scanParticleFile(const char *path, int *n, int *numTypes) {
+    // number of particles and types in a particle file, for sizing the buffers
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        fprintf(stderr, "could not read %s\n", path);
+        return false;
+    }
+    char line[256];
+    *n = 0;
+    *numTypes = 0;
+    while (fgets(line, sizeof(line), file) != NULL) {
+        float x, y, vx, vy;
+        int type;
+        if (line[0] == '#' || sscanf(line, "%f %f %f %f %d", &x, &y, &vx, &vy, &type) != 5) continue;
+        if (type < 0) continue;
+        (*n)++;
+        if (type >= *numTypes) *numTypes = type + 1;
+    }
+    fclose(file);
+    if (*n == 0) {
+        fprintf(stderr, "no particles in %s\n", path);
+        return false;
+    }
+    return true;
+}
+
+bool loadParticleFile(ParticleSystem *system, const char *path) {
+    // replaces all particles, lines that are not "x y vx vy type" are skipped
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        fprintf(stderr, "could not read %s\n", path);
+        return false;
+    }
+    char line[256];
+    system->n = 0;
+    system->layoutVersion++;
+    system->gridCurrent = false;
+    while (fgets(line, sizeof(line), file) != NULL) {
+        float x, y, vx, vy;
+        int type;
+        if (line[0] == '#' || sscanf(line, "%f %f %f %f %d", &x, &y, &vx, &vy, &type) != 5) continue;
+        if (type < 0) continue;
+        if (type >= system->m) type %= system->m;
+        int i = addParticle(system, type, boundary(x), boundary(y));
+        system->particles[i].vx = vx;
+        system->particles[i].vy = vy;
+    }
+    fclose(file);
+    return true;
+}
+
+uint64_t snapshotSection(uint64_t *offset, uint64_t bytes) {
+    // reserves an aligned section, returns its offset
+    uint64_t start = *offset;
+    *offset = (start + bytes + SNAPSHOT_ALIGNMENT - 1) / SNAPSHOT_ALIGNMENT * SNAPSHOT_ALIGNMENT;
+    return start;
+}
+
+bool writeSection(FILE *file, uint64_t offset, const void *data, uint64_t bytes) {
+    return fseek(file, (long) offset, SEEK_SET) == 0 && fwrite(data, 1, bytes, file) == bytes;
+}
+
+bool saveSnapshot(ParticleSystem *system, const char *path) {
+    // everything needed to resume the simulation exactly (with the same engine options)
+    SnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, 8);
+    header.version = SNAPSHOT_VERSION;
+    header.byteOrder = SNAPSHOT_BYTE_ORDER;
+    header.particleSize = sizeof(Particle);
+    header.n = system->n;
+    header.m = system->m;
+    header.numFamilies = system->numFamilies;
+    header.rank = system->rank;
+    header.matrixFormat = system->matrixFormat;
+    header.activeMatrixFormat = system->activeMatrixFormat;
+    header.stepsSinceReorder = system->stepsSinceReorder;
+    header.rMax = system->rMax;
+    header.frictionHalfLife = system->frictionHalfLife;
+    header.forceFactor = system->forceFactor;
+    header.dt = system->dt;
+    header.quantScale = system->quantScale;
+    memcpy(header.rng, system->rng.s, sizeof(header.rng));
+
+    int m = system->m;
+    uint64_t offset = 0;
+    snapshotSection(&offset, sizeof(SnapshotHeader));
+    header.particlesOffset = snapshotSection(&offset, (uint64_t) system->n * sizeof(Particle));
+    header.matrixOffset = snapshotSection(&offset, m * m * sizeof(float));
+    header.familyOffset = snapshotSection(&offset, m * sizeof(int));
+    header.blockMatrixOffset = snapshotSection(&offset, system->numFamilies * system->numFamilies * sizeof(float));
+    header.factorUOffset = snapshotSection(&offset, m * system->rank * sizeof(float));
+    header.factorVOffset = snapshotSection(&offset, m * system->rank * sizeof(float));
+    header.quantMatrixOffset = snapshotSection(&offset, m * m * sizeof(signed char));
+    header.fileSize = header.quantMatrixOffset + m * m * sizeof(signed char);
+
+    // write a temporary file first, so that a failed save keeps the old snapshot
+    char tmpPath[strlen(path) + 5];
+    sprintf(tmpPath, "%s.tmp", path);
+    FILE *file = fopen(tmpPath, "wb");
+    if (file == NULL) {
+        fprintf(stderr, "could not write %s\n", tmpPath);
+        return false;
+    }
+    bool ok = writeSection(file, 0, &header, sizeof(header))
+            && writeSection(file, header.particlesOffset, system->particles, (uint64_t) system->n * sizeof(Particle))
+            && writeSection(file, header.matrixOffset, system->matrix, m * m * sizeof(float))
+            && writeSection(file, header.familyOffset, system->family, m * sizeof(int))
+            && writeSection(file, header.blockMatrixOffset, system->blockMatrix,
+                    system->numFamilies * system->numFamilies * sizeof(float))
+            && writeSection(file, header.factorUOffset, system->factorU, m * system->rank * sizeof(float))
+            && writeSection(file, header.factorVOffset, system->factorV, m * system->rank * sizeof(float))
+            && writeSection(file, header.quantMatrixOffset, system->quantMatrix, m * m * sizeof(signed char));
+    ok = (fclose(file) == 0) && ok;
+    if (!ok || rename(tmpPath, path) != 0) {
+        fprintf(stderr, "could not write %s\n", path);
+        remove(tmpPath);
+        return false;
+    }
+    return true;
+}
+
+bool readSnapshotHeader(const char *path, SnapshotHeader *header) {
+    // false if the file is no snapshot of this build
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) return false;
+    bool ok = fread(header, sizeof(SnapshotHeader), 1, file) == 1;
+    fclose(file);
+    return ok && memcmp(header->magic, SNAPSHOT_MAGIC, 8) == 0;
+}
+
+bool checkSnapshotHeader(SnapshotHeader *header, uint64_t fileSize, const char *path) {
+    uint64_t n = header->n;
+    uint64_t m = header->m;
+    uint64_t f = header->numFamilies;
+    uint64_t r = header->rank;
+    bool ok = header->version == SNAPSHOT_VERSION
+            && header->byteOrder == SNAPSHOT_BYTE_ORDER
+            && header->particleSize == sizeof(Particle)
+            && header->fileSize == fileSize
+            && header->n > 0 && header->m > 0
+            && header->numFamilies > 0 && header->numFamilies <= header->m
+            && header->rank > 0 && header->rank <= header->m
+            && header->matrixFormat >= MATRIX_FORMAT_AUTO && header->matrixFormat <= MATRIX_FORMAT_QUANTIZED
+            && header->activeMatrixFormat >= MATRIX_FORMAT_DENSE
+            && header->activeMatrixFormat <= MATRIX_FORMAT_QUANTIZED
+            && (header->matrixFormat == MATRIX_FORMAT_AUTO || header->activeMatrixFormat == header->matrixFormat)
+            && header->rMax > 0.0f
+            && header->particlesOffset % SNAPSHOT_ALIGNMENT == 0
+            && header->particlesOffset + n * sizeof(Particle) <= fileSize
+            && header->matrixOffset + m * m * sizeof(float) <= fileSize
+            && header->familyOffset % sizeof(int) == 0
+            && header->familyOffset + m * sizeof(int) <= fileSize
+            && header->blockMatrixOffset + f * f * sizeof(float) <= fileSize
+            && header->factorUOffset + m * r * sizeof(float) <= fileSize
+            && header->factorVOffset + m * r * sizeof(float) <= fileSize
+            && header->quantMatrixOffset + m * m <= fileSize;
+    if (!ok) fprintf(stderr, "%s is not a valid snapshot for this build\n", path);
+    return ok;
+}
+
+bool checkSnapshotFamilies(SnapshotHeader *header, const char *base, const char *path) {
+    // the block format indexes blockMatrix with these
+    const int *family = (const int *) (base + header->familyOffset);
+    for (int i = 0; i < header->m; i++) {
+        if (family[i] < 0 || family[i] >= header->numFamilies) {
+            fprintf(stderr, "%s is not a valid snapshot for this build\n", path);
+            return false;
+        }
+    }
+    return true;
+}
+
+bool loadSnapshot(ParticleSystem *system, const char *path) {
+    // maps the file and uses its particle array in place (copy-on-write)
+    SnapshotHeader header;
+    if (!readSnapshotHeader(path, &header)) {
+        fprintf(stderr, "could not read snapshot %s\n", path);
+        return false;
+    }
+    if (system->forceKernel != NULL && header.matrixFormat > MATRIX_FORMAT_DENSE) {
+        // the kernel only knows the dense matrix
+        fprintf(stderr, "%s uses matrix format %d, which --force-expr does not support\n", path, header.matrixFormat);
+        return false;
+    }
+    uint64_t fileSize = header.fileSize;
+#ifdef __unix__
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        if (fd >= 0) close(fd);
+        fprintf(stderr, "could not read snapshot %s\n", path);
+        return false;
+    }
+    fileSize = st.st_size;
+    if (!checkSnapshotHeader(&header, fileSize, path)) {
+        close(fd);
+        return false;
+    }
+    char *base = mmap(NULL, fileSize, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        fprintf(stderr, "could not map snapshot %s\n", path);
+        return false;
+    }
+    if (!checkSnapshotFamilies(&header, base, path)) {
+        munmap(base, fileSize);
+        return false;
+    }
+    arenaAdopt(system->arena, base, fileSize);
+#else
+    if (!checkSnapshotHeader(&header, fileSize, path)) return false;
+    char *base = arenaAlloc(system->arena, fileSize, false);
+    FILE *file = fopen(path, "rb");
+    bool ok = file != NULL && fread(base, 1, fileSize, file) == fileSize;
+    if (file != NULL) fclose(file);
+    if (!ok) {
+        fprintf(stderr, "could not read snapshot %s\n", path);
+        return false;
+    }
+    if (!checkSnapshotFamilies(&header, base, path)) return false;
+#endif
+
+    // only invalid particles are written, so that untouched pages stay shared with the page cache
+    Particle *particles = (Particle *) (base + header.particlesOffset);
+    for (int i = 0; i < header.n; i++) {
+        Particle *p = &particles[i];
+        if (p->type < 0 || p->type >= header.m) p->type = 0;
+        if (!(p->x >= -1.0f && p->x < 1.0f)) p->x = isfinite(p->x) ? boundary(p->x) : 0.0f;
+        if (!(p->y >= -1.0f && p->y < 1.0f)) p->y = isfinite(p->y) ? boundary(p->y) : 0.0f;
+    }
+    arenaRelease(system->arena, system->particles, system->capacity * sizeof(Particle));
+    system->particles = particles;
+    system->n = header.n;
+    resizeParticleBuffers(system, header.n);
+
+    // matrix buffers of the right size, shared ones are kept if large enough
+    Arena *arena = system->arena;
+    reserveTypes(system, header.m);
+    if (header.rank > system->rank) {
+        arenaRelease(arena, system->factorU, system->typeCapacity * system->rank * sizeof(float));
+        arenaRelease(arena, system->factorV, system->typeCapacity * system->rank * sizeof(float));
+        system->factorU = arenaAlloc(arena, system->typeCapacity * header.rank * sizeof(float), false);
+        system->factorV = arenaAlloc(arena, system->typeCapacity * header.rank * sizeof(float), false);
+    }
+    int m = header.m;
+    system->m = m;
+    system->numFamilies = header.numFamilies;
+    system->rank = header.rank;
+    memcpy(system->matrix, base + header.matrixOffset, m * m * sizeof(float));
+    memcpy(system->family, base + header.familyOffset, m * sizeof(int));
+    memcpy(system->blockMatrix, base + header.blockMatrixOffset, header.numFamilies * header.numFamilies * sizeof(float));
+    memcpy(system->factorU, base + header.factorUOffset, m * header.rank * sizeof(float));
+    memcpy(system->factorV, base + header.factorVOffset, m * header.rank * sizeof(float));
+    memcpy(system->quantMatrix, base + header.quantMatrixOffset, m * m * sizeof(signed char));
+    system->matrixFormat = header.matrixFormat;
+    system->activeMatrixFormat = header.activeMatrixFormat;
+    system->quantScale = header.quantScale;
+
+    system->stepsSinceReorder = header.stepsSinceReorder;
+    system->frictionHalfLife = header.frictionHalfLife;
+    system->forceFactor = header.forceFactor;
+    system->dt = header.dt;
+    system->rMax = header.rMax;
+    resizeGrid(system);
+    memcpy(system->rng.s, header.rng, sizeof(header.rng));
+    system->layoutVersion++;
+    return true;
+}
+
+bool saveFile(ParticleSystem *system, const char *path) {
+    return hasSuffix(path, ".snap") ? saveSnapshot(system, path) : saveParticleFile(system, path);
+}
+
+// a matrix given with -A or in a settings file, applied instead of a random one
+typedef struct {
+    int m;
+    float *values;              // m x m, row major, NULL if none was given
+} Matrix;
+
+// header of a binary matrix file, followed by m x m floats
+typedef struct {
+    char magic[8];              // MATRIX_MAGIC
+    uint32_t byteOrder;         // SNAPSHOT_BYTE_ORDER as written by this machine
+    int32_t m;
+} MatrixFileHeader;
+
+// one entry of a settings file, pointing to the variable it sets
+typedef struct {
+    const char *name;
+    int type;                   // SETTING_*
+    void *value;                // strings are on the heap, setSetting() frees the one it replaces
+    bool *given;                // set to true when loaded, if not NULL
+    bool live;                  // applied to a running simulation by --watch-settings
+    double min;                 // smallest valid value, or length of a string
+    double max;                 // largest valid value, or length of a string
+} Setting;
+
+bool parseMatrix(const char *text, Matrix *matrix, const char *source) {
+    // numbers separated by whitespace, commas or semicolons, the count must be a square
+    int count = 0;
+    int capacity = 64;
+    float *values = malloc(capacity * sizeof(float));
+    const char *p = text;
+    while (true) {
+        p += strspn(p, " \t\r\n,;");
+        if (*p == '\0') break;
+        char *end;
+        float value = strtof(p, &end);
+        if (end == p) {
+            fprintf(stderr, "%s: not a number: %.16s\n", source, p);
+            free(values);
+            return false;
+        }
+        if (count == capacity) {
+            capacity *= 2;
+            values = realloc(values, capacity * sizeof(float));
+        }
+        values[count++] = value;
+        p = end;
+    }
+    int m = (int) lround(sqrt((double) count));
+    if (count == 0 || m * m != count) {
+        fprintf(stderr, "%s: %d values do not form a square matrix\n", source, count);
+        free(values);
+        return false;
+    }
+    free(matrix->values);
+    matrix->m = m;
+    matrix->values = values;
+    return true;
+}
+
+bool saveMatrixFile(const char *path, const float *values, int m) {
+    FILE *file = fopen(path, "wb");
+    if (file == NULL) {
+        fprintf(stderr, "could not write %s\n", path);
+        return false;
+    }
+    MatrixFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MATRIX_MAGIC, sizeof(header.magic));
+    header.byteOrder = SNAPSHOT_BYTE_ORDER;
+    header.m = m;
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1
+            && fwrite(values, sizeof(float), (size_t) m * m, file) == (size_t) m * m;
+    return fclose(file) == 0 && ok;
+}
+
+bool loadMatrixFile(const char *path, Matrix *matrix) {
+    // binary (see saveMatrixFile()) or text, as accepted by parseMatrix()
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        fprintf(stderr, "could not read %s\n", path);
+        return false;
+    }
+    long size = fseek(file, 0, SEEK_END) == 0 ? ftell(file) : -1;
+    if (size < 0 || fseek(file, 0, SEEK_SET) != 0) {
+        fprintf(stderr, "could not read %s\n", path);
+        fclose(file);
+        return false;
+    }
+    char *data = malloc(size + 1);
+    bool ok = fread(data, 1, size, file) == (size_t) size;
+    fclose(file);
+    data[ok ? size : 0] = '\0';
+
+    MatrixFileHeader header;
+    if (ok && size >= (long) sizeof(header) && memcmp(data, MATRIX_MAGIC, sizeof(header.magic)) == 0) {
+        memcpy(&header, data, sizeof(header));
+        if (header.byteOrder != SNAPSHOT_BYTE_ORDER || header.m <= 0
+                || size != (long) (sizeof(header) + (size_t) header.m * header.m * sizeof(float))) {
+            fprintf(stderr, "%s: invalid matrix file or different byte order\n", path);
+            ok = false;
+        } else {
+            free(matrix->values);
+            matrix->m = header.m;
+            matrix->values = malloc((size_t) header.m * header.m * sizeof(float));
+            memcpy(matrix->values, data + sizeof(header), (size_t) header.m * header.m * sizeof(float));
+        }
+    } else if (ok) {
+        ok = parseMatrix(data, matrix, path);
+    }
+    free(data);
+    return ok;
+}
+
+bool loadMatrixArgument(const char *arg, Matrix *matrix) {
+    // -A <matrix>: a matrix file, or the values themselves ("1,0.5,-0.2,1")
+    if (access(arg, R_OK) == 0) return loadMatrixFile(arg, matrix);
+    return parseMatrix(arg, matrix, "-A");
+}
+
+void siblingPath(char *out, size_t size, const char *path, const char *name) {
+    // "name" relative to the directory of "path"
+    const char *slash = strrchr(path, '/');
+    if (name[0] == '/' || slash == NULL) {
+        snprintf(out, size, "%s", name);
+    } else {
+        snprintf(out, size, "%.*s/%s", (int) (slash - path), path, name);
+    }
+}
+
+bool setSetting(Setting *setting, const char *value, const char *path, int line) {
+    // the variable is only changed if the whole value is valid
+    char *end = NULL;           // end of the parsed value, NULL if invalid
+    double number = 0.0;        // the parsed value, or the length of a string
+    switch (setting->type) {
+        case SETTING_INT:
+            number = (double) strtol(value, &end, 10);
+            break;
+        case SETTING_FLOAT:
+            number = strtof(value, &end);
+            break;
+        case SETTING_BOOL:
+            // a flag without a value is on
+            if (value[0] == '\0' || strcmp(value, "1") == 0 || strcmp(value, "true") == 0) {
+                number = 1.0;
+            } else if (strcmp(value, "0") != 0 && strcmp(value, "false") != 0) {
+                break;
+            }
+            end = (char *) value + strlen(value);
+            break;
+        case SETTING_STRING:
+            number = (double) strlen(value);
+            end = (char *) value + strlen(value);
+            break;
+    }
+    // NaN fails the range check too
+    if (end == NULL || (end == value && setting->type != SETTING_BOOL) || *end != '\0'
+            || !(number >= setting->min && number <= setting->max)) {
+        fprintf(stderr, "%s:%d: invalid value for %s: %s\n", path, line, setting->name, value);
+        return false;
+    }
+    switch (setting->type) {
+        case SETTING_INT:
+            *(int *) setting->value = (int) number;
+            break;
+        case SETTING_FLOAT:
+            *(float *) setting->value = (float) number;
+            break;
+        case SETTING_BOOL:
+            *(bool *) setting->value = number != 0.0;
+            break;
+        case SETTING_STRING:
+            free(*(char **) setting->value);
+            *(char **) setting->value = strdup(value);
+            break;
+    }
+    if (setting->given != NULL) *setting->given = true;
+    return true;
+}
+
+bool loadSettings(const char *path, Setting *settings, int numSettings, Matrix *matrix, bool reload) {
+    // "name value" per line, '#' starts a comment. "matrix <file>" names a matrix file,
+    // a bare "matrix" is followed by the rows. On reload only the live settings are set.
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        fprintf(stderr, "could not read %s\n", path);
+        return false;
+    }
+    bool ok = true;
+    char line[4096];
+    int lineNumber = 0;
+    char *rows = NULL;          // text of an inline matrix
+    size_t rowsLength = 0;
+    while (fgets(line, sizeof(line), file) != NULL) {
+        lineNumber++;
+        char *comment = strchr(line, '#');
+        if (comment != NULL) *comment = '\0';
+        char *name = line + strspn(line, " \t");
+        size_t nameLength = strcspn(name, " \t\r\n");
+        if (nameLength == 0) continue;
+        char *value = name + nameLength;
+        value += strspn(value, " \t");
+        value[strcspn(value, "\r\n")] = '\0';
+        for (size_t end = strlen(value); end > 0 && (value[end - 1] == ' ' || value[end - 1] == '\t'); end--) {
+            value[end - 1] = '\0';
+        }
+
+        if (rows != NULL) {
+            // rows of the inline matrix continue up to the next name
+            char *end;
+            strtof(name, &end);
+            if (end != name) {
+                size_t length = strlen(name);
+                rows = realloc(rows, rowsLength + length + 2);
+                memcpy(rows + rowsLength, name, length);
+                rowsLength += length;
+                rows[rowsLength++] = '\n';
+                rows[rowsLength] = '\0';
+                continue;
+            }
+            ok = parseMatrix(rows, matrix, path) && ok;
+            free(rows);
+            rows = NULL;
+        }
+        name[nameLength] = '\0';
+
+        if (strcmp(name, "matrix") == 0) {
+            if (value[0] == '\0') {
+                rows = calloc(1, 1);
+                rowsLength = 0;
+            } else {
+                char matrixPath[1024];
+                siblingPath(matrixPath, sizeof(matrixPath), path, value);
+                ok = loadMatrixFile(matrixPath, matrix) && ok;
+            }
+            continue;
+        }
+        int i = 0;
+        while (i < numSettings && strcmp(settings[i].name, name) != 0) i++;
+        if (i == numSettings) {
+            fprintf(stderr, "%s:%d: unknown setting %s\n", path, lineNumber, name);
+            ok = false;
+        } else if (!reload || settings[i].live) {
+            ok = setSetting(&settings[i], value, path, lineNumber) && ok;
+        }
+    }
+    if (rows != NULL) {
+        ok = parseMatrix(rows, matrix, path) && ok;
+        free(rows);
+    }
+    fclose(file);
+    return ok;
+}
+
+bool saveSettings(const char *path, Setting *settings, int numSettings, ParticleSystem *system) {
+    // in the format read by loadSettings(), large matrices go into a binary file next to it
+    FILE *file = fopen(path, "w");
+    if (file == NULL) {
+        fprintf(stderr, "could not write %s\n", path);
+        return false;
+    }
+    fprintf(file, "# particle-life settings\n");
+    for (int i = 0; i < numSettings; i++) {
+        Setting *setting = &settings[i];
+        if (setting->type != SETTING_BOOL && setting->given != NULL && !*setting->given) continue;
+        switch (setting->type) {
+            case SETTING_INT:
+                fprintf(file, "%s %d\n", setting->name, *(int *) setting->value);
+                break;
+            case SETTING_FLOAT:
+                fprintf(file, "%s %.9g\n", setting->name, *(float *) setting->value);
+                break;
+            case SETTING_BOOL:
+                fprintf(file, "%s %d\n", setting->name, *(bool *) setting->value);
+                break;
+            case SETTING_STRING:
+                if (*(char **) setting->value != NULL) {
+                    fprintf(file, "%s %s\n", setting->name, *(char **) setting->value);
+                }
+                break;
+        }
+    }
+    // the matrix before compression. matrix-format, families and rank above derive the
+    // same representation from it again, so lossy formats continue bit for bit
+    int m = system->m;
+    bool ok = true;
+    fprintf(file, "# before matrix-format %d is applied\n", system->matrixFormat);
+    if (m > SETTINGS_INLINE_MATRIX) {
+        char matrixPath[1024];
+        snprintf(matrixPath, sizeof(matrixPath), "%s.matrix", path);
+        const char *slash = strrchr(matrixPath, '/');
+        fprintf(file, "matrix %s\n", slash != NULL ? slash + 1 : matrixPath);
+        ok = saveMatrixFile(matrixPath, system->matrix, m);
+    } else {
+        fprintf(file, "matrix\n");
+        for (int i = 0; i < m; i++) {
+            for (int j = 0; j < m; j++) {
+                fprintf(file, j == 0 ? "%.9g" : " %.9g", system->matrix[i * m + j]);
+            }
+            fprintf(file, "\n");
+        }
+    }
+    return fclose(file) == 0 && ok;
+}
+
+long long fileModified(const char *path) {
+    // modification time in nanoseconds, 0 if unknown
+#ifdef __linux__
+    struct stat info;
+    if (stat(path, &info) != 0) return 0;
+    return (long long) info.st_mtim.tv_sec * 1000000000LL + info.st_mtim.tv_nsec;
+#elif __unix__
+    struct stat info;
+    if (stat(path, &info) != 0) return 0;
+    return (long long) info.st_mtime * 1000000000LL;
+#else
+    return 0;
+#endif
+}
+
+void applyMatrix(ParticleSystem *system, Matrix *matrix) {
+    if (matrix->values == NULL || matrix->m != system->m) return;
+    memcpy(system->matrix, matrix->values, (size_t) matrix->m * matrix->m * sizeof(float));
+    compressMatrix(system, MATRIX_FORMAT_DENSE);
+}
+
+// header of a recorded trajectory, followed by frames (RecordFrameHeader, block sizes, blocks)
+typedef struct {
+    char magic[8];              // RECORD_MAGIC
+    uint32_t version;           // RECORD_VERSION
+    uint32_t flags;             // RECORD_VELOCITIES
+    int32_t m;
+    int32_t every;              // steps between frames
+    float dt;
+    float rMax;
+} RecordHeader;
+
+typedef struct {
+    uint64_t step;              // steps since the recording started
+    int32_t n;
+    uint32_t flags;             // RECORD_KEYFRAME, RECORD_PREDICTED, RECORD_VELOCITIES
+    float velocityScale;        // velocity of the quantized value 32767
+    uint32_t numBlocks;         // ceil(n / RECORD_BLOCK_SIZE)
+} RecordFrameHeader;
+
+// positions (and velocities) quantized to 16 bits by the simulation thread
+typedef struct {
+    RecordFrameHeader header;
+    int capacity;
+    uint16_t *values;           // x, y, vx, vy per particle
+    int *types;
+} RecordFrame;
+
+typedef struct {
+    FILE *file;
+    int every;
+    bool velocities;
+    bool wait;                  // wait for the writer when the queue is full instead of dropping the frame
+    long long step;
+    int layoutVersion;          // of the last captured frame
+    int lastN;
+    bool keyframePending;       // the next captured frame must not be a delta
+    int framesSinceKeyframe;
+    RecordFrame queue[RECORD_QUEUE_LENGTH];
+    int head;
+    int count;
+#ifdef __unix__
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_cond_t space;       // signaled when the writer has taken a frame from the queue
+    bool quit;
+#endif
+    // writer state
+    uint16_t *previous;         // values of the last written frame
+    uint16_t *older;            // values of the frame before
+    int previousCapacity;
+    int history;                // frames written since the last keyframe
+    unsigned char *buffer;
+    size_t bufferCapacity;
+    uint32_t *blockSizes;
+    uint64_t bytes;
+    uint64_t frames;
+    uint64_t particleFrames;
+    uint64_t dropped;
+    uint64_t failed;            // frames not written, the file ends before the first of them
+} Recorder;
+
+unsigned char *putVarint(unsigned char *out, uint32_t value) {
+    while (value >= 0x80) {
+        *out++ = (unsigned char) (value | 0x80);
+        value >>= 7;
+    }
+    *out++ = (unsigned char) value;
+    return out;
+}
+
+const unsigned char *getVarint(const unsigned char *in, const unsigned char *end, uint32_t *value) {
+    // NULL if the input ends early
+    *value = 0;
+    for (int shift = 0; shift < 35 && in < end; shift += 7) {
+        unsigned char byte = *in++;
+        *value |= (uint32_t) (byte & 0x7f) << shift;
+        if (byte < 0x80) return in;
+    }
+    return NULL;
+}
+
+uint32_t zigzag(int32_t value) {
+    return ((uint32_t) value << 1) ^ (uint32_t) (value >> 31);
+}
+
+int32_t unzigzag(uint32_t value) {
+    return (int32_t) (value >> 1) ^ -(int32_t) (value & 1);
+}
+
+uint16_t recordPrediction(uint32_t flags, uint16_t previous, uint16_t older) {
+    // modulo 2^16, so that particles crossing the boundary give small deltas, too
+    if (flags & RECORD_KEYFRAME) return 0;
+    if (flags & RECORD_PREDICTED) return (uint16_t) (2 * previous - older);
+    return previous;
+}
+
+size_t encodeRecordBlock(RecordFrame *frame, uint16_t *previous, uint16_t *older, int start, int stop,
+        unsigned char *out) {
+    // zigzag varints of the 16 bit differences to the predicted values
+    uint32_t flags = frame->header.flags;
+    int numValues = (flags & RECORD_VELOCITIES) ? 4 : 2;
+    unsigned char *p = out;
+    for (int i = start; i < stop; i++) {
+        if (flags & RECORD_KEYFRAME) p = putVarint(p, frame->types[i]);
+        for (int c = 0; c < numValues; c++) {
+            int k = 4 * i + c;
+            uint16_t base = recordPrediction(flags, previous[k], older[k]);
+            p = putVarint(p, zigzag((int16_t) (uint16_t) (frame->values[k] - base)));
+        }
+    }
+    return p - out;
+}
+
+bool decodeRecordBlock(RecordFrame *frame, uint16_t *older, int start, int stop,
+        const unsigned char *in, const unsigned char *end) {
+    // inverse of encodeRecordBlock(), frame->values holds the previous frame and becomes this one
+    uint32_t flags = frame->header.flags;
+    int numValues = (flags & RECORD_VELOCITIES) ? 4 : 2;
+    for (int i = start; i < stop; i++) {
+        uint32_t value;
+        if (flags & RECORD_KEYFRAME) {
+            if ((in = getVarint(in, end, &value)) == NULL) return false;
+            frame->types[i] = (int) value;
+        }
+        for (int c = 0; c < numValues; c++) {
+            if ((in = getVarint(in, end, &value)) == NULL) return false;
+            int k = 4 * i + c;
+            uint16_t previous = frame->values[k];
+            frame->values[k] = (uint16_t) (recordPrediction(flags, previous, older[k]) + (uint16_t) unzigzag(value));
+            older[k] = previous;
+        }
+    }
+    return in == end;
+}
+
+void reserveRecordFrame(RecordFrame *frame, int n) {
+    if (n <= frame->capacity) return;
+    frame->capacity = n;
+    frame->values = realloc(frame->values, 4 * (size_t) n * sizeof(uint16_t));
+    frame->types = realloc(frame->types, (size_t) n * sizeof(int));
+}
+
+void captureRecordFrame(RecordFrame *frame, ParticleSystem *system, bool velocities) {
+    // quantizes the particles into frame->values, the step and flags are left to the caller
+    int n = system->n;
+    float maxV = 0.0f;
+    if (velocities) {
+        for (int i = 0; i < n; i++) {
+            maxV = fmaxf(maxV, fmaxf(fabsf(system->particles[i].vx), fabsf(system->particles[i].vy)));
+        }
+    }
+    float vScale = (maxV > 0.0f) ? 32767.0f / maxV : 0.0f;
+    for (int i = 0; i < n; i++) {
+        Particle *p = &system->particles[i];
+        uint16_t *values = &frame->values[4 * i];
+        // [-1, 1) to [0, 65536), rounding may give 65536 just below 1
+        long x = (long) ((p->x + 1.0f) * 32768.0f);
+        long y = (long) ((p->y + 1.0f) * 32768.0f);
+        values[0] = (uint16_t) (x < 65535 ? x : 65535);
+        values[1] = (uint16_t) (y < 65535 ? y : 65535);
+        values[2] = (uint16_t) (int16_t) lroundf(p->vx * vScale);
+        values[3] = (uint16_t) (int16_t) lroundf(p->vy * vScale);
+        frame->types[i] = p->type;
+    }
+    frame->header.n = n;
+    frame->header.velocityScale = maxV;
+    frame->header.numBlocks = (n + RECORD_BLOCK_SIZE - 1) / RECORD_BLOCK_SIZE;
+}
+
+void frameParticle(RecordFrame *frame, int i, Particle *particle) {
+    // inverse of captureRecordFrame()
+    uint16_t *values = &frame->values[4 * i];
+    float vScale = frame->header.velocityScale / 32767.0f;
+    particle->type = frame->types[i];
+    particle->x = values[0] / 32768.0f - 1.0f;
+    particle->y = values[1] / 32768.0f - 1.0f;
+    particle->vx = (frame->header.flags & RECORD_VELOCITIES) ? (int16_t) values[2] * vScale : 0.0f;
+    particle->vy = (frame->header.flags & RECORD_VELOCITIES) ? (int16_t) values[3] * vScale : 0.0f;
+}
+
+void writeRecordFrame(Recorder *recorder, RecordFrame *frame) {
+    // after a failed write the deltas have no base anymore, so nothing follows it
+    if (recorder->failed > 0) {
+        recorder->failed++;
+        return;
+    }
+    int n = frame->header.n;
+    if (n > recorder->previousCapacity) {
+        recorder->previous = realloc(recorder->previous, 4 * (size_t) n * sizeof(uint16_t));
+        recorder->older = realloc(recorder->older, 4 * (size_t) n * sizeof(uint16_t));
+        recorder->previousCapacity = n;
+        // worst case of 5 bytes for the type and 3 bytes per value
+        recorder->bufferCapacity = (size_t) n * 17;
+        recorder->buffer = realloc(recorder->buffer, recorder->bufferCapacity);
+        recorder->blockSizes = realloc(recorder->blockSizes,
+                ((n + RECORD_BLOCK_SIZE - 1) / RECORD_BLOCK_SIZE) * sizeof(uint32_t));
+    }
+    // extrapolate once two frames of the same layout were written
+    recorder->history = (frame->header.flags & RECORD_KEYFRAME) ? 0 : recorder->history;
+    if (recorder->history >= 2) frame->header.flags |= RECORD_PREDICTED;
+    recorder->history++;
+
+    size_t size = 0;
+    int numBlocks = frame->header.numBlocks;
+    for (int b = 0; b < numBlocks; b++) {
+        int start = b * RECORD_BLOCK_SIZE;
+        int stop = (start + RECORD_BLOCK_SIZE < n) ? start + RECORD_BLOCK_SIZE : n;
+        size_t blockSize = encodeRecordBlock(frame, recorder->previous, recorder->older, start, stop,
+                recorder->buffer + size);
+        recorder->blockSizes[b] = (uint32_t) blockSize;
+        size += blockSize;
+    }
+    uint16_t *temp = recorder->older;
+    recorder->older = recorder->previous;
+    recorder->previous = temp;
+    memcpy(recorder->previous, frame->values, 4 * (size_t) n * sizeof(uint16_t));
+
+    if (fwrite(&frame->header, sizeof(RecordFrameHeader), 1, recorder->file) != 1
+            || fwrite(recorder->blockSizes, sizeof(uint32_t), numBlocks, recorder->file) != (size_t) numBlocks
+            || fwrite(recorder->buffer, 1, size, recorder->file) != size) {
+        recorder->failed++;
+        return;
+    }
+    recorder->bytes += sizeof(RecordFrameHeader) + numBlocks * sizeof(uint32_t) + size;
+    recorder->frames++;
+    recorder->particleFrames += n;
+}
+
+#ifdef __unix__
+void *recordWriterMain(void *arg) {
+    // encodes and writes the captured frames, so that the simulation never waits for the disk
+    Recorder *recorder = (Recorder *) arg;
+    while (true) {
+        pthread_mutex_lock(&recorder->lock);
+        while (recorder->count == 0 && !recorder->quit) {
+            pthread_cond_wait(&recorder->cond, &recorder->lock);
+        }
+        if (recorder->count == 0) {
+            pthread_mutex_unlock(&recorder->lock);
+            return NULL;
+        }
+        RecordFrame *frame = &recorder->queue[recorder->head];
+        pthread_mutex_unlock(&recorder->lock);
+
+        writeRecordFrame(recorder, frame);
+
+        pthread_mutex_lock(&recorder->lock);
+        recorder->head = (recorder->head + 1) % RECORD_QUEUE_LENGTH;
+        recorder->count--;
+        pthread_cond_signal(&recorder->space);
+        pthread_mutex_unlock(&recorder->lock);
+    }
+}
+#endif
+
+Recorder *startRecording(ParticleSystem *system, const char *path, int every, bool velocities, bool wait) {
+    FILE *file = fopen(path, "wb");
+    if (file == NULL) {
+        fprintf(stderr, "could not write %s\n", path);
+        return NULL;
+    }
+    RecordHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, RECORD_MAGIC, 8);
+    header.version = RECORD_VERSION;
+    header.flags = velocities ? RECORD_VELOCITIES : 0;
+    header.m = system->m;
+    header.every = every;
+    header.dt = system->dt;
+    header.rMax = system->rMax;
+    if (fwrite(&header, sizeof(header), 1, file) != 1) {
+        fprintf(stderr, "could not write %s\n", path);
+        fclose(file);
+        return NULL;
+    }
+
+    Recorder *recorder = calloc(1, sizeof(Recorder));
+    recorder->file = file;
+    recorder->every = every;
+    recorder->velocities = velocities;
+    recorder->wait = wait;
+    recorder->keyframePending = true;
+    recorder->bytes = sizeof(header);
+#ifdef __unix__
+    pthread_mutex_init(&recorder->lock, NULL);
+    pthread_cond_init(&recorder->cond, NULL);
+    pthread_cond_init(&recorder->space, NULL);
+    pthread_create(&recorder->thread, NULL, recordWriterMain, recorder);
+#endif
+    return recorder;
+}
+
+void recordSteps(Recorder *recorder, ParticleSystem *system, int steps) {
+    // captures a frame if a multiple of "every" steps was reached
+    if (recorder == NULL) return;
+    long long before = recorder->step;
+    recorder->step += steps;
+    if (recorder->step / recorder->every == before / recorder->every) return;
+
+    RecordFrame *frame;
+#ifdef __unix__
+    pthread_mutex_lock(&recorder->lock);
+    while (recorder->wait && recorder->count == RECORD_QUEUE_LENGTH) {
+        // headless recordings keep every frame, the simulation waits for the writer
+        pthread_cond_wait(&recorder->space, &recorder->lock);
+    }
+    bool full = recorder->count == RECORD_QUEUE_LENGTH;
+    frame = &recorder->queue[(recorder->head + recorder->count) % RECORD_QUEUE_LENGTH];
+    pthread_mutex_unlock(&recorder->lock);
+    if (full) {
+        // the disk is too slow, skip this frame instead of stalling the GUI
+        recorder->dropped++;
+        recorder->keyframePending = true;
+        return;
+    }
+#else
+    frame = &recorder->queue[0];
+#endif
+
+    int n = system->n;
+    reserveRecordFrame(frame, n);
+    // with --procs, domainGather() concatenates the slabs in a new order every
+    // frame, so such recordings consist of keyframes only
+    bool keyframe = recorder->keyframePending || n != recorder->lastN
+            || system->layoutVersion != recorder->layoutVersion
+            || recorder->framesSinceKeyframe >= RECORD_KEYFRAME_INTERVAL;
+    recorder->keyframePending = false;
+    recorder->lastN = n;
+    recorder->layoutVersion = system->layoutVersion;
+    recorder->framesSinceKeyframe = keyframe ? 1 : recorder->framesSinceKeyframe + 1;
+
+    captureRecordFrame(frame, system, recorder->velocities);
+    frame->header.step = recorder->step;
+    frame->header.flags = (keyframe ? RECORD_KEYFRAME : 0) | (recorder->velocities ? RECORD_VELOCITIES : 0);
+
+#ifdef __unix__
+    pthread_mutex_lock(&recorder->lock);
+    recorder->count++;
+    pthread_cond_signal(&recorder->cond);
+    pthread_mutex_unlock(&recorder->lock);
+#else
+    writeRecordFrame(recorder, frame);
+#endif
+}
+
+void printRecordStats(uint64_t bytes, uint64_t frames, uint64_t particleFrames) {
+    fprintf(stderr, "%llu frames, %llu bytes, %.2f bytes per particle per frame\n",
+            (unsigned long long) frames, (unsigned long long) bytes,
+            particleFrames > 0 ? (double) bytes / (double) particleFrames : 0.0);
+}
+
+void stopRecording(Recorder *recorder) {
+    if (recorder == NULL) return;
+#ifdef __unix__
+    pthread_mutex_lock(&recorder->lock);
+    recorder->quit = true;
+    pthread_cond_signal(&recorder->cond);
+    pthread_mutex_unlock(&recorder->lock);
+    pthread_join(recorder->thread, NULL);
+#endif
+    // buffered frames are lost if the final flush fails
+    if (fclose(recorder->file) != 0 && recorder->failed == 0) recorder->failed = 1;
+    fprintf(stderr, "recorded ");
+    printRecordStats(recorder->bytes, recorder->frames, recorder->particleFrames);
+    if (recorder->dropped > 0) {
+        fprintf(stderr, "%llu frames dropped, the disk was too slow\n", (unsigned long long) recorder->dropped);
+    }
+    if (recorder->failed > 0) {
+        fprintf(stderr, "%llu frames could not be written, the recording is incomplete\n",
+                (unsigned long long) recorder->failed);
+    }
+    for (int i = 0; i < RECORD_QUEUE_LENGTH; i++) {
+        free(recorder->queue[i].values);
+        free(recorder->queue[i].types);
+    }
+    free(recorder->previous);
+    free(recorder->older);
+    free(recorder->buffer);
+    free(recorder->blockSizes);
+    free(recorder);
+}
+
+// sequential reader of a recorded trajectory
+typedef struct {
+    FILE *file;
+    RecordHeader header;
+    RecordFrame frame;          // values hold the decoded frame
+    uint16_t *older;            // values of the frame before
+    unsigned char *buffer;
+    size_t bufferCapacity;
+    uint32_t *blockSizes;
+    int blockCapacity;
+    bool hasKeyframe;
+    int lastN;
+    uint64_t bytes;
+    uint64_t frames;
+    uint64_t particleFrames;
+} RecordReader;
+
+bool openRecord(RecordReader *reader, const char *path) {
+    memset(reader, 0, sizeof(RecordReader));
+    reader->file = fopen(path, "rb");
+    if (reader->file == NULL) {
+        fprintf(stderr, "could not read %s\n", path);
+        return false;
+    }
+    if (fread(&reader->header, sizeof(RecordHeader), 1, reader->file) != 1
+            || memcmp(reader->header.magic, RECORD_MAGIC, 8) != 0
+            || reader->header.version != RECORD_VERSION) {
+        fprintf(stderr, "%s is not a recording of this version\n", path);
+        fclose(reader->file);
+        return false;
+    }
+    reader->bytes = sizeof(RecordHeader);
+    return true;
+}
+
+bool readRecordFrame(RecordReader *reader) {
+    // decodes the next frame into reader->frame, false at the end or on errors
+    RecordFrame *frame = &reader->frame;
+    if (fread(&frame->header, sizeof(RecordFrameHeader), 1, reader->file) != 1) return false;
+    int n = frame->header.n;
+    int numBlocks = frame->header.numBlocks;
+    if (n < 0 || numBlocks != (n + RECORD_BLOCK_SIZE - 1) / RECORD_BLOCK_SIZE) return false;
+    if (!(frame->header.flags & RECORD_KEYFRAME) && (!reader->hasKeyframe || n != reader->lastN)) return false;
+    if (n > frame->capacity) {
+        reserveRecordFrame(frame, n);
+        reader->older = realloc(reader->older, 4 * (size_t) n * sizeof(uint16_t));
+    }
+    if (numBlocks > reader->blockCapacity) {
+        reader->blockCapacity = numBlocks;
+        reader->blockSizes = realloc(reader->blockSizes, numBlocks * sizeof(uint32_t));
+    }
+    if (fread(reader->blockSizes, sizeof(uint32_t), numBlocks, reader->file) != (size_t) numBlocks) return false;
+    reader->bytes += sizeof(RecordFrameHeader) + numBlocks * sizeof(uint32_t);
+    for (int b = 0; b < numBlocks; b++) {
+        size_t size = reader->blockSizes[b];
+        if (size > reader->bufferCapacity) {
+            reader->bufferCapacity = size;
+            reader->buffer = realloc(reader->buffer, size);
+        }
+        if (fread(reader->buffer, 1, size, reader->file) != size) return false;
+        int start = b * RECORD_BLOCK_SIZE;
+        int stop = (start + RECORD_BLOCK_SIZE < n) ? start + RECORD_BLOCK_SIZE : n;
+        if (!decodeRecordBlock(frame, reader->older, start, stop, reader->buffer, reader->buffer + size)) return false;
+        reader->bytes += size;
+    }
+    reader->hasKeyframe = true;
+    reader->lastN = n;
+    reader->frames++;
+    reader->particleFrames += n;
+    return true;
+}
+
+void recordParticle(RecordReader *reader, int i, Particle *particle) {
+    // the i-th particle of the current frame
+    frameParticle(&reader->frame, i, particle);
+}
+
+void closeRecord(RecordReader *reader) {
+    fclose(reader->file);
+    free(reader->frame.values);
+    free(reader->frame.types);
+    free(reader->older);
+    free(reader->buffer);
+    free(reader->blockSizes);
+}
+
+int printRecord(const char *path) {
+    // text dump of a recording: "# step n" before each frame, then "x y [vx vy] type" per particle
+    RecordReader reader;
+    if (!openRecord(&reader, path)) return EXIT_FAILURE;
+    bool velocities = reader.header.flags & RECORD_VELOCITIES;
+    printf("# m %d every %d dt %g rmax %g\n", reader.header.m, reader.header.every, reader.header.dt, reader.header.rMax);
+    while (readRecordFrame(&reader)) {
+        printf("# step %llu n %d\n", (unsigned long long) reader.frame.header.step, reader.frame.header.n);
+        for (int i = 0; i < reader.frame.header.n; i++) {
+            Particle p;
+            recordParticle(&reader, i, &p);
+            if (velocities) {
+                printf("%.6f %.6f %.6f %.6f %d\n", p.x, p.y, p.vx, p.vy, p.type);
+            } else {
+                printf("%.6f %.6f %d\n", p.x, p.y, p.type);
+            }
+        }
+    }
+    bool complete = feof(reader.file) && ftell(reader.file) == (long) reader.bytes;
+    if (!complete) fprintf(stderr, "%s is truncated or damaged, stopped after %llu frames\n",
+            path, (unsigned long long) reader.frames);
+    printRecordStats(reader.bytes, reader.frames, reader.particleFrames);
+    closeRecord(&reader);
+    return complete ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// playback of a recording from the mapped file, see openReplay()
+typedef struct {
+    RecordHeader header;
+    const unsigned char *data;  // the whole file, read by the kernel on demand
+    size_t size;
+    uint64_t *frameOffsets;     // index of all complete frames
+    uint64_t *frameSteps;
+    int numFrames;
+    int maxN;
+    int current;                // frame in "frame", -1 if none
+    RecordFrame frame;
+    uint16_t *older;            // scratch for decodeRecordBlock()
+    const unsigned char **blocks;  // of the frame being decoded, numBlocks + 1 pointers
+    atomic_int damagedBlocks;   // of the frame being decoded
+    long long step;             // playback position
+} Replay;
+
+bool openReplay(Replay *replay, const char *path) {
+    // maps the file and indexes the frames, only their headers are read
+    memset(replay, 0, sizeof(Replay));
+    replay->current = -1;
+#ifdef __unix__
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        if (fd >= 0) close(fd);
+        fprintf(stderr, "could not read %s\n", path);
+        return false;
+    }
+    replay->size = st.st_size;
+    void *data = replay->size > 0 ? mmap(NULL, replay->size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "could not map %s\n", path);
+        return false;
+    }
+    replay->data = data;
+#else
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        fprintf(stderr, "could not read %s\n", path);
+        return false;
+    }
+    fseek(file, 0, SEEK_END);
+    replay->size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    unsigned char *data = malloc(replay->size);
+    replay->size = fread(data, 1, replay->size, file);
+    fclose(file);
+    replay->data = data;
+#endif
+    if (replay->size < sizeof(RecordHeader)) replay->size = 0;
+    if (replay->size > 0) memcpy(&replay->header, replay->data, sizeof(RecordHeader));
+    if (replay->size == 0 || memcmp(replay->header.magic, RECORD_MAGIC, 8) != 0
+            || replay->header.version != RECORD_VERSION) {
+        fprintf(stderr, "%s is not a recording of this version\n", path);
+        return false;
+    }
+
+    int capacity = 0;
+    uint64_t offset = sizeof(RecordHeader);
+    bool hasKeyframe = false;
+    while (offset + sizeof(RecordFrameHeader) <= replay->size) {
+        RecordFrameHeader header;
+        memcpy(&header, replay->data + offset, sizeof(header));
+        if (header.n < 0 || header.numBlocks != (uint32_t) ((header.n + RECORD_BLOCK_SIZE - 1) / RECORD_BLOCK_SIZE)) {
+            break;
+        }
+        uint64_t end = offset + sizeof(header) + header.numBlocks * sizeof(uint32_t);
+        if (end > replay->size) break;
+        for (uint32_t b = 0; b < header.numBlocks; b++) {
+            uint32_t blockSize;
+            memcpy(&blockSize, replay->data + offset + sizeof(header) + b * sizeof(uint32_t), sizeof(blockSize));
+            end += blockSize;
+        }
+        if (end > replay->size) break;
+        // frames before the first keyframe cannot be decoded
+        hasKeyframe = hasKeyframe || (header.flags & RECORD_KEYFRAME);
+        if (hasKeyframe) {
+            if (replay->numFrames == capacity) {
+                capacity = capacity > 0 ? 2 * capacity : 1024;
+                replay->frameOffsets = realloc(replay->frameOffsets, capacity * sizeof(uint64_t));
+                replay->frameSteps = realloc(replay->frameSteps, capacity * sizeof(uint64_t));
+            }
+            replay->frameOffsets[replay->numFrames] = offset;
+            replay->frameSteps[replay->numFrames] = header.step;
+            replay->numFrames++;
+            if (header.n > replay->maxN) replay->maxN = header.n;
+        }
+        offset = end;
+    }
+    if (replay->numFrames == 0) {
+        fprintf(stderr, "%s contains no frames\n", path);
+        return false;
+    }
+    if (offset != replay->size) {
+        fprintf(stderr, "%s is truncated or damaged, playing %d frames\n", path, replay->numFrames);
+    }
+    reserveRecordFrame(&replay->frame, replay->maxN);
+    replay->older = malloc(4 * (size_t) replay->maxN * sizeof(uint16_t));
+    replay->blocks = malloc(((replay->maxN + RECORD_BLOCK_SIZE - 1) / RECORD_BLOCK_SIZE + 1) * sizeof(unsigned char *));
+    replay->step = replay->frameSteps[0];
+    return true;
+}
+
+RecordFrameHeader replayFrameHeader(Replay *replay, int i) {
+    RecordFrameHeader header;
+    memcpy(&header, replay->data + replay->frameOffsets[i], sizeof(header));
+    return header;
+}
+
+void decodeReplayJob(void *arg, int thread, int numThreads) {
+    Replay *replay = (Replay *) arg;
+    RecordFrame *frame = &replay->frame;
+    int start, stop;
+    blockRange(frame->header.numBlocks, 1, thread, numThreads, &start, &stop);
+    for (int b = start; b < stop; b++) {
+        int first = b * RECORD_BLOCK_SIZE;
+        int last = (first + RECORD_BLOCK_SIZE < frame->header.n) ? first + RECORD_BLOCK_SIZE : frame->header.n;
+        if (!decodeRecordBlock(frame, replay->older, first, last, replay->blocks[b], replay->blocks[b + 1])) {
+            atomic_fetch_add(&replay->damagedBlocks, 1);
+        }
+    }
+}
+
+bool decodeReplayFrame(Replay *replay, ThreadPool *threads, int i) {
+    // on top of the current frame, the blocks in parallel. false if the frame is damaged
+    RecordFrame *frame = &replay->frame;
+    frame->header = replayFrameHeader(replay, i);
+    const unsigned char *blockSizes = replay->data + replay->frameOffsets[i] + sizeof(RecordFrameHeader);
+    replay->blocks[0] = blockSizes + frame->header.numBlocks * sizeof(uint32_t);
+    for (uint32_t b = 0; b < frame->header.numBlocks; b++) {
+        uint32_t size;
+        memcpy(&size, blockSizes + b * sizeof(uint32_t), sizeof(size));
+        replay->blocks[b + 1] = replay->blocks[b] + size;
+    }
+    atomic_store(&replay->damagedBlocks, 0);
+    runJob(threads, decodeReplayJob, replay);
+    if (atomic_load(&replay->damagedBlocks) > 0) {
+        // the following deltas have no valid base either
+        replay->current = -1;
+        return false;
+    }
+#ifdef __unix__
+    if (i + 1 < replay->numFrames) {
+        // read the next frame ahead, recordings may be larger than the memory
+        uintptr_t page = (uintptr_t) sysconf(_SC_PAGESIZE);
+        uintptr_t start = (uintptr_t) (replay->data + replay->frameOffsets[i + 1]) & ~(page - 1);
+        uintptr_t end = (uintptr_t) (i + 2 < replay->numFrames
+                ? replay->data + replay->frameOffsets[i + 2] : replay->data + replay->size);
+        madvise((void *) start, end - start, MADV_WILLNEED);
+    }
+#endif
+    replay->current = i;
+    return true;
+}
+
+bool seekReplay(Replay *replay, ParticleSystem *system, long long step) {
+    // shows the last frame at or before "step", false if "step" is past the end
+    // or the frame could not be decoded
+    if (step < (long long) replay->frameSteps[0]) step = replay->frameSteps[0];
+    int lo = 0;
+    int hi = replay->numFrames - 1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if ((long long) replay->frameSteps[mid] <= step) lo = mid; else hi = mid - 1;
+    }
+    int target = lo;
+    if (target != replay->current) {
+        // continue from the current frame when going forward, unless a keyframe is closer
+        bool forward = replay->current >= 0 && target > replay->current;
+        int first = target;
+        while (!(replayFrameHeader(replay, first).flags & RECORD_KEYFRAME) && !(forward && first == replay->current + 1)) {
+            first--;
+        }
+        for (int i = first; i <= target; i++) {
+            if (!decodeReplayFrame(replay, system->threads, i)) {
+                fprintf(stderr, "the frame at step %llu is damaged\n", (unsigned long long) replay->frameSteps[i]);
+                return false;
+            }
+        }
+    }
+    RecordFrame *frame = &replay->frame;
+    system->n = frame->header.n;
+    for (int i = 0; i < frame->header.n; i++) {
+        Particle *p = &system->particles[i];
+        frameParticle(frame, i, p);
+        if (p->type < 0) p->type = 0;
+        if (p->type >= system->m) p->type %= system->m;
+    }
+    long long last = replay->frameSteps[replay->numFrames - 1];
+    replay->step = step < last ? step : last;
+    return step <= last;
+}
+
+void closeReplay(Replay *replay) {
+#ifdef __unix__
+    if (replay->data != NULL) munmap((void *) replay->data, replay->size);
+#else
+    free((void *) replay->data);
+#endif
+    free(replay->frameOffsets);
+    free(replay->frameSteps);
+    free(replay->frame.values);
+    free(replay->frame.types);
+    free(replay->older);
+    free(replay->blocks);
+}
+
+// headless image sequences, rasterised by the worker threads and encoded by a writer thread
+typedef struct {
+    unsigned char *rgb;         // w * h pixels
+    uint64_t number;
+} ImageFrame;
+
+typedef struct {
+    const char *dir;
+    int format;                 // IMAGE_FORMAT_PPM or IMAGE_FORMAT_PNG
+    int w;
+    int h;
+    uint32_t *accum;            // r, g, b and particle count per pixel
+    unsigned char palette[3 * 256];
+    int paletteTypes;           // number of types the palette was made for
+    bool color;
+    uint64_t number;            // frames queued so far, numbers the files
+    ImageFrame queue[IMAGE_QUEUE_LENGTH];
+    int head;
+    int count;
+#ifdef __unix__
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;        // a frame was queued
+    pthread_cond_t space;       // a frame was written
+    bool quit;
+#endif
+    // writer state
+    unsigned char *filtered;    // PNG rows, each preceded by its filter byte
+    unsigned char *compressed;
+    int32_t *hashTable;
+    uint32_t crcTable[256];
+    uint64_t frames;
+    uint64_t bytes;
+} ImageExporter;
+
+typedef struct {
+    ImageExporter *exporter;
+    ParticleSystem *system;
+    unsigned char *rgb;
+    float zoom;
+    float shiftX;
+    float shiftY;
+    bool clear;
+} ImageJob;
+
+void imageRowsJob(void *arg, int thread, int numThreads) {
+    // every thread scans all particles, but only accumulates its own band of rows
+    ImageJob *job = (ImageJob *) arg;
+    ImageExporter *exporter = job->exporter;
+    ParticleSystem *system = job->system;
+    int w = exporter->w;
+    int start, stop;
+    blockRange(exporter->h, 1, thread, numThreads, &start, &stop);
+    uint32_t *accum = exporter->accum + (size_t) start * w * 4;
+    if (job->clear) memset(accum, 0, (size_t) (stop - start) * w * 4 * sizeof(uint32_t));
+
+    for (int i = 0; i < system->n; i++) {
+        Particle *p = &system->particles[i];
+        int x, y;
+        if (!projectParticle(p, w, exporter->h, 1.0f, job->zoom, job->shiftX, job->shiftY, &x, &y)) continue;
+        if (y < start || y >= stop) continue;
+        uint32_t *pixel = exporter->accum + ((size_t) y * w + x) * 4;
+        const unsigned char *color = exporter->palette + 3 * (p->type % 256);
+        pixel[0] += color[0];
+        pixel[1] += color[1];
+        pixel[2] += color[2];
+        pixel[3]++;
+    }
+
+    // a single particle shows its color, denser pixels get brighter up to twice as bright
+    unsigned char *out = job->rgb + (size_t) start * w * 3;
+    for (size_t i = 0; i < (size_t) (stop - start) * w; i++) {
+        uint32_t *pixel = accum + i * 4;
+        for (int c = 0; c < 3; c++) {
+            uint32_t value = 2 * pixel[c] / (pixel[3] + 1);
+            out[i * 3 + c] = (unsigned char) (value < 255 ? value : 255);
+        }
+    }
+}
+
+void makeImagePalette(ImageExporter *exporter, int m) {
+    // hues evenly spread over the types, at 70% brightness to leave room for dense pixels
+    for (int i = 0; i < 256; i++) {
+        float hue = 6.0f * (float) (i % m) / (float) m;
+        float rgb[3] = {0.7f, 0.7f, 0.7f};
+        if (exporter->color) {
+            int sector = (int) hue;
+            float f = hue - (float) sector;
+            float up = 0.7f * f;
+            float down = 0.7f * (1.0f - f);
+            float table[6][3] = {
+                {0.7f, up, 0}, {down, 0.7f, 0}, {0, 0.7f, up},
+                {0, down, 0.7f}, {up, 0, 0.7f}, {0.7f, 0, down},
+            };
+            memcpy(rgb, table[sector % 6], sizeof(rgb));
+        }
+        for (int c = 0; c < 3; c++) exporter->palette[3 * i + c] = (unsigned char) (255.0f * rgb[c] + 0.5f);
+    }
+    exporter->paletteTypes = m;
+}
+
+uint32_t pngCrc(ImageExporter *exporter, uint32_t crc, const unsigned char *data, size_t size) {
+    for (size_t i = 0; i < size; i++) crc = exporter->crcTable[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+typedef struct {
+    unsigned char *out;
+    uint64_t bits;
+    int count;
+} BitWriter;
+
+void putBits(BitWriter *writer, uint32_t value, int bits) {
+    // deflate packs values starting with the least significant bit
+    writer->bits |= (uint64_t) value << writer->count;
+    writer->count += bits;
+    while (writer->count >= 8) {
+        *writer->out++ = (unsigned char) writer->bits;
+        writer->bits >>= 8;
+        writer->count -= 8;
+    }
+}
+
+void putFixedCode(BitWriter *writer, int symbol) {
+    // the fixed Huffman code of a literal/length symbol, most significant bit first
+    uint32_t code;
+    int bits;
+    if (symbol < 144) {
+        code = 0x30 + symbol;
+        bits = 8;
+    } else if (symbol < 256) {
+        code = 0x190 + symbol - 144;
+        bits = 9;
+    } else if (symbol < 280) {
+        code = symbol - 256;
+        bits = 7;
+    } else {
+        code = 0xc0 + symbol - 280;
+        bits = 8;
+    }
+    uint32_t reversed = 0;
+    for (int i = 0; i < bits; i++) reversed |= ((code >> i) & 1) << (bits - 1 - i);
+    putBits(writer, reversed, bits);
+}
+
+size_t deflateFast(ImageExporter *exporter, const unsigned char *in, size_t size, unsigned char *out) {
+    // zlib stream of one fixed Huffman block, greedy matches found by a single probe hash table
+    static const int lengthBase[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+            35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+    static const int lengthExtra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+            3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+    static const int distanceBase[30] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+            257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+    static const int distanceExtra[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+            7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+    int32_t *table = exporter->hashTable;
+    for (int i = 0; i < IMAGE_HASH_SIZE; i++) table[i] = -1;
+
+    BitWriter writer = {out, 0, 0};
+    putBits(&writer, 0x78, 8);
+    putBits(&writer, 0x01, 8);
+    putBits(&writer, 1, 1);  // final block
+    putBits(&writer, 1, 2);  // fixed Huffman codes
+    size_t i = 0;
+    while (i < size) {
+        int length = 0;
+        size_t distance = 0;
+        if (i + 3 <= size) {
+            uint32_t key = (uint32_t) in[i] | (uint32_t) in[i + 1] << 8 | (uint32_t) in[i + 2] << 16;
+            uint32_t hash = (key * 2654435761u) >> (32 - IMAGE_HASH_BITS);
+            int32_t candidate = table[hash];
+            table[hash] = (int32_t) i;
+            if (candidate >= 0 && i - (size_t) candidate <= 32768) {
+                size_t limit = size - i < 258 ? size - i : 258;
+                while ((size_t) length < limit && in[candidate + length] == in[i + length]) length++;
+                distance = i - (size_t) candidate;
+            }
+        }
+        if (length < 3) {
+            putFixedCode(&writer, in[i]);
+            i++;
+            continue;
+        }
+        int code = 28;
+        while (lengthBase[code] > length) code--;
+        putFixedCode(&writer, 257 + code);
+        putBits(&writer, length - lengthBase[code], lengthExtra[code]);
+        code = 29;
+        while (distanceBase[code] > (int) distance) code--;
+        uint32_t reversed = 0;
+        for (int b = 0; b < 5; b++) reversed |= ((code >> b) & 1) << (4 - b);
+        putBits(&writer, reversed, 5);
+        putBits(&writer, (uint32_t) distance - distanceBase[code], distanceExtra[code]);
+        i += length;
+    }
+    putFixedCode(&writer, 256);
+    putBits(&writer, 0, 7);  // pad to a whole byte
+
+    uint32_t a = 1, b = 0;
+    for (size_t j = 0; j < size; j++) {
+        a = (a + in[j]) % 65521;
+        b = (b + a) % 65521;
+    }
+    uint32_t adler = b << 16 | a;
+    for (int shift = 24; shift >= 0; shift -= 8) *writer.out++ = (unsigned char) (adler >> shift);
+    return (size_t) (writer.out - out);
+}
+
+void putBigEndian32(unsigned char *out, uint32_t value) {
+    out[0] = (unsigned char) (value >> 24);
+    out[1] = (unsigned char) (value >> 16);
+    out[2] = (unsigned char) (value >> 8);
+    out[3] = (unsigned char) value;
+}
+
+bool writePngChunk(ImageExporter *exporter, FILE *file, const char *type, const unsigned char *data, size_t size) {
+    unsigned char header[8];
+    putBigEndian32(header, (uint32_t) size);
+    memcpy(header + 4, type, 4);
+    uint32_t crc = pngCrc(exporter, 0xffffffffu, header + 4, 4);
+    crc = pngCrc(exporter, crc, data, size) ^ 0xffffffffu;
+    unsigned char trailer[4];
+    putBigEndian32(trailer, crc);
+    exporter->bytes += size + 12;
+    return fwrite(header, 1, 8, file) == 8 && fwrite(data, 1, size, file) == size
+            && fwrite(trailer, 1, 4, file) == 4;
+}
+
+void writeImageFrame(ImageExporter *exporter, ImageFrame *frame) {
+    int w = exporter->w;
+    int h = exporter->h;
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/frame-%06llu.%s", exporter->dir, (unsigned long long) frame->number,
+            exporter->format == IMAGE_FORMAT_PNG ? "png" : "ppm");
+    FILE *file = fopen(path, "wb");
+    if (file == NULL) {
+        fprintf(stderr, "could not write %s\n", path);
+        return;
+    }
+    bool ok;
+    if (exporter->format == IMAGE_FORMAT_PNG) {
+        size_t rowBytes = (size_t) w * 3;
+        for (int y = 0; y < h; y++) {
+            exporter->filtered[y * (rowBytes + 1)] = 0;  // no filter
+            memcpy(exporter->filtered + y * (rowBytes + 1) + 1, frame->rgb + y * rowBytes, rowBytes);
+        }
+        size_t size = deflateFast(exporter, exporter->filtered, h * (rowBytes + 1), exporter->compressed);
+        unsigned char header[13] = {0};
+        putBigEndian32(header, w);
+        putBigEndian32(header + 4, h);
+        header[8] = 8;  // bits per channel
+        header[9] = 2;  // RGB
+        static const unsigned char signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+        exporter->bytes += sizeof(signature);
+        ok = fwrite(signature, 1, sizeof(signature), file) == sizeof(signature)
+                && writePngChunk(exporter, file, "IHDR", header, sizeof(header))
+                && writePngChunk(exporter, file, "IDAT", exporter->compressed, size)
+                && writePngChunk(exporter, file, "IEND", NULL, 0);
+    } else {
+        int headerSize = fprintf(file, "P6\n%d %d\n255\n", w, h);
+        size_t size = (size_t) w * h * 3;
+        exporter->bytes += headerSize + size;
+        ok = headerSize > 0 && fwrite(frame->rgb, 1, size, file) == size;
+    }
+    if (fclose(file) != 0 || !ok) {
+        fprintf(stderr, "could not write %s\n", path);
+    }
+    exporter->frames++;
+}
+
+#ifdef __unix__
+void *imageWriterMain(void *arg) {
+    // encodes and writes the rendered images, so that the simulation only waits for a slow disk
+    ImageExporter *exporter = (ImageExporter *) arg;
+    while (true) {
+        pthread_mutex_lock(&exporter->lock);
+        while (exporter->count == 0 && !exporter->quit) {
+            pthread_cond_wait(&exporter->cond, &exporter->lock);
+        }
+        if (exporter->count == 0) {
+            pthread_mutex_unlock(&exporter->lock);
+            return NULL;
+        }
+        ImageFrame *frame = &exporter->queue[exporter->head];
+        pthread_mutex_unlock(&exporter->lock);
+
+        writeImageFrame(exporter, frame);
+
+        pthread_mutex_lock(&exporter->lock);
+        exporter->head = (exporter->head + 1) % IMAGE_QUEUE_LENGTH;
+        exporter->count--;
+        pthread_cond_signal(&exporter->space);
+        pthread_mutex_unlock(&exporter->lock);
+    }
+}
+#endif
+
+ImageExporter *startImageExport(const char *dir, int format, int w, int h, bool color) {
+#ifdef __unix__
+    mkdir(dir, 0777);  // may exist already
+#endif
+    ImageExporter *exporter = calloc(1, sizeof(ImageExporter));
+    exporter->dir = dir;
+    exporter->format = format;
+    exporter->w = w;
+    exporter->h = h;
+    exporter->color = color;
+    exporter->accum = calloc((size_t) w * h * 4, sizeof(uint32_t));
+    for (int i = 0; i < IMAGE_QUEUE_LENGTH; i++) {
+        exporter->queue[i].rgb = malloc((size_t) w * h * 3);
+    }
+    if (format == IMAGE_FORMAT_PNG) {
+        size_t size = (size_t) h * (w * 3 + 1);
+        exporter->filtered = malloc(size);
+        // 9 bits for the worst literal, plus the zlib header and checksum
+        exporter->compressed = malloc(size + size / 8 + 64);
+        exporter->hashTable = malloc(IMAGE_HASH_SIZE * sizeof(int32_t));
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++) c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+            exporter->crcTable[i] = c;
+        }
+    }
+#ifdef __unix__
+    pthread_mutex_init(&exporter->lock, NULL);
+    pthread_cond_init(&exporter->cond, NULL);
+    pthread_cond_init(&exporter->space, NULL);
+    pthread_create(&exporter->thread, NULL, imageWriterMain, exporter);
+#endif
+    return exporter;
+}
+
+void exportImage(ImageExporter *exporter, ParticleSystem *system, float zoom, float shiftX, float shiftY, bool clear) {
+    ImageFrame *frame;
+    uint64_t number = exporter->number++;
+#ifdef __unix__
+    pthread_mutex_lock(&exporter->lock);
+    while (exporter->count == IMAGE_QUEUE_LENGTH) {
+        // the disk is too slow. without a GUI to keep responsive, every frame is kept
+        pthread_cond_wait(&exporter->space, &exporter->lock);
+    }
+    frame = &exporter->queue[(exporter->head + exporter->count) % IMAGE_QUEUE_LENGTH];
+    pthread_mutex_unlock(&exporter->lock);
+#else
+    frame = &exporter->queue[0];
+#endif
+
+    if (exporter->paletteTypes != system->m) makeImagePalette(exporter, system->m);
+    ImageJob job = {exporter, system, frame->rgb, zoom, shiftX, shiftY, clear};
+    runJob(system->threads, imageRowsJob, &job);
+    frame->number = number;
+
+#ifdef __unix__
+    pthread_mutex_lock(&exporter->lock);
+    exporter->count++;
+    pthread_cond_signal(&exporter->cond);
+    pthread_mutex_unlock(&exporter->lock);
+#else
+    writeImageFrame(exporter, frame);
+#endif
+}
+
+void stopImageExport(ImageExporter *exporter) {
+    if (exporter == NULL) return;
+#ifdef __unix__
+    pthread_mutex_lock(&exporter->lock);
+    exporter->quit = true;
+    pthread_cond_signal(&exporter->cond);
+    pthread_mutex_unlock(&exporter->lock);
+    pthread_join(exporter->thread, NULL);
+    pthread_cond_destroy(&exporter->space);
+    pthread_cond_destroy(&exporter->cond);
+    pthread_mutex_destroy(&exporter->lock);
+#endif
+    fprintf(stderr, "exported %llu images, %llu bytes\n",
+            (unsigned long long) exporter->frames, (unsigned long long) exporter->bytes);
+    for (int i = 0; i < IMAGE_QUEUE_LENGTH; i++) free(exporter->queue[i].rgb);
+    free(exporter->accum);
+    free(exporter->filtered);
+    free(exporter->compressed);
+    free(exporter->hashTable);
+    free(exporter);
+}
+
+double diffMs(struct timespec *start, struct timespec *end) {
+    // in ms
+    return (((double) (end->tv_sec - start->tv_sec)) * 1000.0 +
+            ((double) (end->tv_nsec - start->tv_nsec)) / 1000000.0);
+}
+
+void startTimer(struct timespec *t) {
+    clock_gettime(CLOCK_MONOTONIC, t);
+}
+
+double stopTimer(struct timespec *t) {
+    // after this call, t contains the current time
+    struct timespec t0 = *t;
+    clock_gettime(CLOCK_MONOTONIC, t);
+    return diffMs(&t0, t);
+}
+
+// periodic snapshots written by a forked copy of the process
+typedef struct {
+    int every;                  // steps between checkpoints, 0 = never
+    const char *base;           // checkpoints go to <base>.<slot>.snap, see checkpointPath()
+    int stepsSinceCheckpoint;
+    int started;
+    int written;
+    int skipped;                // the previous checkpoint was still being written
+    int failed;
+    int writer;                 // process id of the writing child, 0 if none
+    struct timespec writerStart;
+    char lastPath[1100];        // last completed checkpoint
+    double lastStallMs;         // time the simulation was stopped for the last checkpoint
+    double maxStallMs;
+    double totalStallMs;
+    double totalWriteMs;
+} Checkpointer;
+
+void checkpointPath(Checkpointer *checkpointer, int slot, char *path, size_t size) {
+    // particle-life.snap -> particle-life.0.snap
+    const char *base = checkpointer->base;
+    int length = (int) strlen(base);
+    if (hasSuffix(base, ".snap")) length -= 5;
+    snprintf(path, size, "%.*s.%d.snap", length, base, slot);
+}
+
+void finishCheckpoint(Checkpointer *checkpointer, bool wait) {
+    // reaps the writing child, if it is done (or "wait")
+#ifdef __unix__
+    if (checkpointer->writer == 0) return;
+    int status;
+    pid_t pid = waitpid(checkpointer->writer, &status, wait ? 0 : WNOHANG);
+    if (pid == 0) return;
+    checkpointer->writer = 0;
+    checkpointer->totalWriteMs += stopTimer(&checkpointer->writerStart);
+    if (pid > 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+        checkpointer->written++;
+        checkpointPath(checkpointer, (checkpointer->started - 1) % CHECKPOINT_FILES,
+                checkpointer->lastPath, sizeof(checkpointer->lastPath));
+    } else {
+        checkpointer->failed++;
+    }
+#endif
+}
+
+void checkpointSteps(Checkpointer *checkpointer, ParticleSystem *system, int steps) {
+    // the child writes the snapshot from its copy-on-write view of the memory,
+    // the parent only waits for fork() to copy the page tables
+    if (checkpointer->every <= 0) return;
+    checkpointer->stepsSinceCheckpoint += steps;
+    finishCheckpoint(checkpointer, false);
+    if (checkpointer->stepsSinceCheckpoint < checkpointer->every) return;
+    if (checkpointer->writer != 0) {
+        // rather one checkpoint less than a pile of writers competing for the disk
+        checkpointer->skipped++;
+        return;
+    }
+    checkpointer->stepsSinceCheckpoint = 0;
+
+    char path[1100];
+    checkpointPath(checkpointer, checkpointer->started % CHECKPOINT_FILES, path, sizeof(path));
+    struct timespec t;
+    startTimer(&t);
+#ifdef __unix__
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        // only this thread exists in the child, saveSnapshot() does not need the others
+        nice(10);  // leave the cores to the simulation
+        _exit(saveSnapshot(system, path) ? 0 : 1);
+    }
+    double stallMs = stopTimer(&t);
+    if (pid < 0) {
+        checkpointer->failed++;
+        return;
+    }
+    checkpointer->writer = pid;
+    checkpointer->writerStart = t;
+#else
+    bool ok = saveSnapshot(system, path);
+    double stallMs = stopTimer(&t);
+    checkpointer->totalWriteMs += stallMs;
+    if (ok) {
+        checkpointer->written++;
+        snprintf(checkpointer->lastPath, sizeof(checkpointer->lastPath), "%s", path);
+    } else {
+        checkpointer->failed++;
+    }
+#endif
+    checkpointer->started++;
+    checkpointer->lastStallMs = stallMs;
+    checkpointer->totalStallMs += stallMs;
+    if (stallMs > checkpointer->maxStallMs) checkpointer->maxStallMs = stallMs;
+}
+
+void stopCheckpoints(Checkpointer *checkpointer) {
+    if (checkpointer->every <= 0) return;
+    finishCheckpoint(checkpointer, true);
+    int started = checkpointer->started;
+    fprintf(stderr, "%d checkpoints written, %d skipped, %d failed, last: %s\n",
+            checkpointer->written, checkpointer->skipped, checkpointer->failed,
+            checkpointer->written > 0 ? checkpointer->lastPath : "none");
+    if (started > 0) {
+        fprintf(stderr, "simulation stalled %.2f ms per checkpoint (max %.2f ms), writing took %.1f ms\n",
+                checkpointer->totalStallMs / started, checkpointer->maxStallMs,
+                checkpointer->totalWriteMs / started);
+    }
+}
+
+typedef struct {
+    int threads;
+    int cellDivisor;
+    int reorderInterval;
+} EngineConfig;
+
+typedef struct {
+    bool enabled;
+    EngineConfig current;   // fastest configuration of the last round
+    double currentMs;       // its time per step
+    EngineConfig candidates[AUTOTUNE_MAX_CANDIDATES];
+    double candidateMs[AUTOTUNE_MAX_CANDIDATES];
+    int numCandidates;
+    int trial;              // candidate being timed, -1 between rounds
+    int trialSteps;
+    double trialMs;
+    int stepsUntilRound;
+} Autotuner;
+
+EngineConfig getEngineConfig(ParticleSystem *system) {
+    EngineConfig config;
+    config.threads = system->threads->activeThreads;
+    config.cellDivisor = system->cellDivisor;
+    config.reorderInterval = system->reorderInterval;
+    return config;
+}
+
+void setEngineConfig(ParticleSystem *system, EngineConfig config) {
+    system->threads->activeThreads = config.threads;
+    system->reorderInterval = config.reorderInterval;
+    if (config.cellDivisor != system->cellDivisor) {
+        system->cellDivisor = config.cellDivisor;
+        resizeGrid(system);
+    }
+}
+
+void addCandidate(Autotuner *tuner, EngineConfig config) {
+    if (tuner->numCandidates < AUTOTUNE_MAX_CANDIDATES) {
+        tuner->candidates[tuner->numCandidates++] = config;
+    }
+}
+
+void startTuningRound(Autotuner *tuner, ParticleSystem *system) {
+    // the current configuration and its neighbours, varying one setting each
+    EngineConfig current = getEngineConfig(system);
+    tuner->numCandidates = 0;
+    addCandidate(tuner, current);
+
+    EngineConfig config = current;
+    if (current.threads > 1) {
+        config.threads = current.threads / 2;
+        addCandidate(tuner, config);
+    }
+    if (current.threads < system->threads->numThreads) {
+        config.threads = current.threads * 2 < system->threads->numThreads
+                ? current.threads * 2 : system->threads->numThreads;
+        addCandidate(tuner, config);
+    }
+
+    config = current;
+    for (int d = 1; d <= 2; d++) {
+        if (d != current.cellDivisor) {
+            config.cellDivisor = d;
+            addCandidate(tuner, config);
+        }
+    }
+
+    config = current;
+    int reorderIntervals[] = {0, 1, 16};
+    for (int i = 0; i < 3; i++) {
+        if (reorderIntervals[i] != current.reorderInterval) {
+            config.reorderInterval = reorderIntervals[i];
+            addCandidate(tuner, config);
+        }
+    }
+
+    tuner->trial = 0;
+    tuner->trialSteps = 0;
+    tuner->trialMs = 0;
+}
+
+void autotuneStep(Autotuner *tuner, ParticleSystem *system) {
+    // one update(), timing trial windows of alternative configurations
+    if (tuner->trial < 0 && --tuner->stepsUntilRound <= 0) {
+        startTuningRound(tuner, system);
+        setEngineConfig(system, tuner->candidates[0]);
+    }
+
+    struct timespec t;
+    startTimer(&t);
+    update(system);
+    double ms = stopTimer(&t);
+
+    if (tuner->trial < 0) return;
+    // the first step of a window absorbs the cost of switching
+    if (tuner->trialSteps++ > 0) tuner->trialMs += ms;
+    if (tuner->trialSteps <= AUTOTUNE_WINDOW) return;
+
+    tuner->candidateMs[tuner->trial] = tuner->trialMs / AUTOTUNE_WINDOW;
+    tuner->trial++;
+    tuner->trialSteps = 0;
+    tuner->trialMs = 0;
+    if (tuner->trial < tuner->numCandidates) {
+        setEngineConfig(system, tuner->candidates[tuner->trial]);
+        return;
+    }
+
+    // round complete: switch to the fastest
+    int best = 0;
+    for (int i = 1; i < tuner->numCandidates; i++) {
+        if (tuner->candidateMs[i] < tuner->candidateMs[best]) best = i;
+    }
+    tuner->current = tuner->candidates[best];
+    tuner->currentMs = tuner->candidateMs[best];
+    setEngineConfig(system, tuner->current);
+    tuner->trial = -1;
+    tuner->stepsUntilRound = AUTOTUNE_INTERVAL;
+}
+
+void simulate(ParticleSystem *system, Domain *domain, Autotuner *tuner, Recorder *recorder, int steps) {
+    if (domain->numWorkers > 1) {
+        domainStep(domain, system, steps);
+        recordSteps(recorder, system, steps);
+    } else if (tuner->enabled) {
+        for (int i = 0; i < steps; i++) {
+            autotuneStep(tuner, system);
+            recordSteps(recorder, system, 1);
+        }
+    } else {
+        for (int i = 0; i < steps; i++) {
+            update(system);
+            recordSteps(recorder, system, 1);
+        }
+    }
+}
+
+// an entry of the rewind history, see rewindSteps()
+typedef struct {
+    long long step;
+    size_t offset;              // of the encoded particles in the ring
+    size_t size;
+    RecordFrameHeader header;   // RECORD_KEYFRAME if the entry does not depend on the one before
+    int stepsSinceReorder;
+} RewindEntry;
+
+typedef struct {
+    size_t budget;              // bytes of the ring, 0 = off
+    int every;                  // steps between entries
+    unsigned char *ring;        // encoded entries, in the order of "entries" (wrapping around)
+    size_t tail;                // end of the newest entry
+    size_t used;                // bytes of all entries
+    RewindEntry *entries;       // oldest first
+    int entryCapacity;
+    int count;
+    long long step;             // steps since the start
+    int stepsSinceEntry;
+    int entriesSinceKeyframe;
+    int layoutVersion;          // of the newest entry
+    unsigned long long fingerprint;  // of the settings the entries were simulated with
+    RecordFrame frame;          // captured or decoded values
+    uint16_t *previous;         // values of the newest entry
+    uint16_t *older;            // scratch for decodeRecordBlock()
+    unsigned char *buffer;      // the entry being added
+} Rewind;
+
+unsigned long long rewindFingerprint(ParticleSystem *system) {
+    // everything that changes the result of a step, except for the particles
+    char key[256];
+    snprintf(key, sizeof(key), "n%d m%d r%.9g t%.9g h%.9g x%.9g c%d o%d y%d g%d",
+            system->n, system->m, system->rMax, system->dt, system->frictionHalfLife, system->forceFactor,
+            system->cellDivisor, system->reorderInterval, system->accuracy, system->ghostCells);
+    unsigned long long hash = hashString(key, 14695981039346656037ULL);
+    return hashBytes(system->matrix, (size_t) system->m * system->m * sizeof(float), hash);
+}
+
+void clearRewind(Rewind *rewind) {
+    rewind->count = 0;
+    rewind->used = 0;
+    rewind->tail = 0;
+}
+
+void dropOldestRewind(Rewind *rewind) {
+    // together with the entries that depend on it
+    int drop = 1;
+    while (drop < rewind->count && !(rewind->entries[drop].header.flags & RECORD_KEYFRAME)) drop++;
+    for (int i = 0; i < drop; i++) rewind->used -= rewind->entries[i].size;
+    rewind->count -= drop;
+    memmove(rewind->entries, rewind->entries + drop, rewind->count * sizeof(RewindEntry));
+    if (rewind->count == 0) rewind->tail = 0;
+}
+
+size_t placeRewindEntry(Rewind *rewind, size_t size) {
+    // drops the oldest entries until "size" bytes are free at the tail, or at the start of the ring
+    size_t offset = rewind->tail;
+    if (offset + size > rewind->budget) {
+        // the entries behind the tail are the oldest
+        while (rewind->count > 0 && rewind->entries[0].offset >= rewind->tail) dropOldestRewind(rewind);
+        offset = 0;
+    }
+    while (rewind->count > 0 && rewind->entries[0].offset < offset + size
+            && offset < rewind->entries[0].offset + rewind->entries[0].size) {
+        dropOldestRewind(rewind);
+    }
+    return rewind->count == 0 ? 0 : offset;
+}
+
+size_t encodeRewindEntry(Rewind *rewind, bool keyframe) {
+    rewind->frame.header.flags = RECORD_VELOCITIES | (keyframe ? RECORD_KEYFRAME : 0);
+    return encodeRecordBlock(&rewind->frame, rewind->previous, rewind->older, 0, rewind->frame.header.n,
+            rewind->buffer);
+}
+
+void addRewindEntry(Rewind *rewind, ParticleSystem *system) {
+    int n = system->n;
+    if (n > rewind->frame.capacity) {
+        reserveRecordFrame(&rewind->frame, n);
+        rewind->previous = realloc(rewind->previous, 4 * (size_t) n * sizeof(uint16_t));
+        rewind->older = realloc(rewind->older, 4 * (size_t) n * sizeof(uint16_t));
+        // worst case of 5 bytes for the type and 3 bytes per value
+        rewind->buffer = realloc(rewind->buffer, (size_t) n * 17);
+    }
+    if (rewind->ring == NULL) rewind->ring = malloc(rewind->budget);
+    unsigned long long fingerprint = rewindFingerprint(system);
+    if (fingerprint != rewind->fingerprint) clearRewind(rewind);
+    rewind->fingerprint = fingerprint;
+
+    // only captured, the simulation keeps its exact values (see rewindTo())
+    captureRecordFrame(&rewind->frame, system, true);
+    rewind->frame.header.step = rewind->step;
+
+    bool keyframe = rewind->count == 0 || system->layoutVersion != rewind->layoutVersion
+            || rewind->entriesSinceKeyframe >= REWIND_KEYFRAME_INTERVAL;
+    size_t size = encodeRewindEntry(rewind, keyframe);
+    size_t offset = placeRewindEntry(rewind, size);
+    if (!keyframe && rewind->count == 0) {
+        // the entry it depends on was dropped
+        keyframe = true;
+        size = encodeRewindEntry(rewind, true);
+    }
+    if (size > rewind->budget) {
+        clearRewind(rewind);
+        return;
+    }
+
+    if (rewind->count == rewind->entryCapacity) {
+        rewind->entryCapacity = rewind->entryCapacity > 0 ? 2 * rewind->entryCapacity : 64;
+        rewind->entries = realloc(rewind->entries, rewind->entryCapacity * sizeof(RewindEntry));
+    }
+    RewindEntry *entry = &rewind->entries[rewind->count++];
+    entry->step = rewind->step;
+    entry->offset = offset;
+    entry->size = size;
+    entry->header = rewind->frame.header;
+    entry->stepsSinceReorder = system->stepsSinceReorder;
+    memcpy(rewind->ring + offset, rewind->buffer, size);
+    rewind->used += size;
+    rewind->tail = offset + size;
+    memcpy(rewind->previous, rewind->frame.values, 4 * (size_t) n * sizeof(uint16_t));
+    rewind->layoutVersion = system->layoutVersion;
+    rewind->entriesSinceKeyframe = keyframe ? 1 : rewind->entriesSinceKeyframe + 1;
+}
+
+void rewindSteps(Rewind *rewind, ParticleSystem *system, int steps) {
+    // adds an entry every "every" steps: the particles quantized like a recording with
+    // velocities, delta coded against the entry before
+    if (rewind->budget == 0) return;
+    rewind->step += steps;
+    rewind->stepsSinceEntry += steps;
+    if (rewind->stepsSinceEntry < rewind->every) return;
+    rewind->stepsSinceEntry = 0;
+    addRewindEntry(rewind, system);
+}
 
+bool rewindTo(Rewind *rewind, ParticleSystem *system, Domain *domain, long long step) {
+    // restores the last entry before "step" and simulates the remaining steps again,
+    // from 16 bit values, so the result is close to the state the simulation had
+    if (rewind->budget == 0 || rewind->count == 0) return false;
+    if (rewindFingerprint(system) != rewind->fingerprint) {
+        // the settings changed since, the entries would not lead to the current state
+        clearRewind(rewind);
+        return false;
+    }
+    if (step < rewind->entries[0].step) step = rewind->entries[0].step;
+    if (step >= rewind->step) return false;
 
-void randomizeMatrix(ParticleSystem *system, int mode) {
-    if (mode < 1 || mode > NUM_MATRIX_MODES) return;
+    int last = rewind->count - 1;
+    while (rewind->entries[last].step > step) last--;
+    int first = last;
+    while (!(rewind->entries[first].header.flags & RECORD_KEYFRAME)) first--;
+    for (int e = first; e <= last; e++) {
+        RewindEntry *entry = &rewind->entries[e];
+        rewind->frame.header = entry->header;
+        unsigned char *data = rewind->ring + entry->offset;
+        decodeRecordBlock(&rewind->frame, rewind->older, 0, entry->header.n, data, data + entry->size);
+    }
+    RewindEntry *entry = &rewind->entries[last];
+    for (int i = 0; i < entry->header.n; i++) {
+        frameParticle(&rewind->frame, i, &system->particles[i]);
+    }
+    system->stepsSinceReorder = entry->stepsSinceReorder;
+    system->layoutVersion++;
+    system->gridCurrent = false;
+    if (domain->numWorkers > 1) domainScatter(domain, system);
 
-    if (mode == 1) {
-        for (int i = 0; i < system->m; i++) {
-            for (int j = 0; j < system->m; j++) {
-                system->matrix[i * system->m + j] = randFloat() * 2.0f - 1.0f;
-            }
-        }
-    } else if (mode == 2) {
-        for (int i = 0; i < system->m; i++) {
-            for (int j = 0; j < system->m; j++) {
-                float val = 0.0f;
-                if (i == j) {
-                    val = 1.0f;
-                }
-                if (i == (j + 1) % system->m) {
-                    val = 0.5f;
-                }
-                system->matrix[i * system->m + j] = val;
-            }
-        }
+    // the later entries will be added again
+    for (int e = last + 1; e < rewind->count; e++) rewind->used -= rewind->entries[e].size;
+    rewind->count = last + 1;
+    rewind->tail = entry->offset + entry->size;
+    memcpy(rewind->previous, rewind->frame.values, 4 * (size_t) entry->header.n * sizeof(uint16_t));
+    rewind->layoutVersion = system->layoutVersion;
+    rewind->entriesSinceKeyframe = last - first + 1;
+    rewind->step = step;
+    rewind->stepsSinceEntry = (int) (step - entry->step);
+
+    // with the current engine settings, which are part of the fingerprint
+    Autotuner fixed;
+    fixed.enabled = false;
+    simulate(system, domain, &fixed, NULL, rewind->stepsSinceEntry);
+    return true;
+}
+
+void freeRewind(Rewind *rewind) {
+    free(rewind->ring);
+    free(rewind->entries);
+    free(rewind->frame.values);
+    free(rewind->frame.types);
+    free(rewind->previous);
+    free(rewind->older);
+    free(rewind->buffer);
+}
+
+// the simulation on its own thread with --sim-thread, the GUI shows its latest state
+#define SIM_SNAPSHOT_FRESH 4    // set on the middle slot when it holds an unseen snapshot
+
+// the values of the info and debug windows that the simulation changes
+typedef struct {
+    int n;
+    int m;
+    float dt;
+    float rMax;
+    size_t rewindUsed;
+    size_t memory;
+    EngineConfig engine;
+    int tuningTrial;
+    int tuningCandidates;
+    double tunedMs;
+    double checkpointStallMs;
+    unsigned long long recordDropped;
+} SimStats;
+
+void collectSimStats(SimStats *stats, ParticleSystem *system, Autotuner *tuner, Rewind *rewind,
+        Checkpointer *checkpointer, Recorder *recorder) {
+    stats->n = system->n;
+    stats->m = system->m;
+    stats->dt = system->dt;
+    stats->rMax = system->rMax;
+    stats->rewindUsed = rewind->used;
+    stats->memory = arenaFootprint(system->arena);
+    stats->engine = tuner->enabled ? tuner->current : getEngineConfig(system);
+    stats->tuningTrial = tuner->trial;
+    stats->tuningCandidates = tuner->numCandidates;
+    stats->tunedMs = tuner->currentMs;
+    stats->checkpointStallMs = checkpointer->lastStallMs;
+    stats->recordDropped = recorder != NULL ? recorder->dropped : 0;
+}
+
+typedef struct {
+    Particle *particles;
+    int capacity;
+    int n;
+    int m;
+    double stepsPerSecond;
+    double msPerUpdate;
+    SimStats stats;
+} SimSnapshot;
+
+#ifdef __unix__
+typedef struct {
+    pthread_t thread;
+    pthread_mutex_t lock;       // held while the system changes, by either thread
+    atomic_int waiting;         // the GUI wants the lock, the simulation steps aside
+    bool quit;
+    // triple buffer: the publisher owns back, the GUI owns front, they swap through middle
+    SimSnapshot slots[3];
+    int back;
+    int front;
+    atomic_int middle;
+    double stepsPerSecond;
+    double msPerUpdate;
+    ParticleSystem view;        // the front snapshot, as shown by the GUI
+    SimStats stats;             // of the front snapshot
+
+    ParticleSystem *system;
+    Domain *domain;
+    Autotuner *tuner;
+    Recorder *recorder;
+    Checkpointer *checkpointer;
+    Rewind *rewind;
+    int *stepsPerFrame;
+    bool *pause;
+} SimThread;
+
+void publishSnapshot(SimThread *sim) {
+    // called with the lock held, so there is only one publisher at a time
+    SimSnapshot *slot = &sim->slots[sim->back];
+    ParticleSystem *system = sim->system;
+    if (slot->capacity < system->n) {
+        free(slot->particles);
+        slot->particles = malloc((size_t) system->n * sizeof(Particle));
+        slot->capacity = system->n;
     }
+    memcpy(slot->particles, system->particles, (size_t) system->n * sizeof(Particle));
+    slot->n = system->n;
+    slot->m = system->m;
+    slot->stepsPerSecond = sim->stepsPerSecond;
+    slot->msPerUpdate = sim->msPerUpdate;
+    collectSimStats(&slot->stats, system, sim->tuner, sim->rewind, sim->checkpointer, sim->recorder);
+    sim->back = atomic_exchange(&sim->middle, sim->back | SIM_SNAPSHOT_FRESH) & ~SIM_SNAPSHOT_FRESH;
 }
 
-void initPositions(ParticleSystem *system, int mode) {
-    if (mode < 1 || mode > NUM_POSITION_MODES) return;
+bool acquireSnapshot(SimThread *sim, double *stepsPerSecond, double *msPerUpdate) {
+    // takes the latest snapshot without waiting, false if it was already shown
+    if (!(atomic_load(&sim->middle) & SIM_SNAPSHOT_FRESH)) return false;
+    sim->front = atomic_exchange(&sim->middle, sim->front) & ~SIM_SNAPSHOT_FRESH;
+    SimSnapshot *slot = &sim->slots[sim->front];
+    sim->view.particles = slot->particles;
+    sim->view.n = slot->n;
+    sim->view.m = slot->m;
+    *stepsPerSecond = slot->stepsPerSecond;
+    *msPerUpdate = slot->msPerUpdate;
+    sim->stats = slot->stats;
+    return true;
+}
 
-    if (mode == 1) {
-        for (int i = 0; i < system->n; i++) {
-            Particle *particle = &system->particles[i];
-            particle->x = randFloat() * 2.0f - 1.0f;
-            particle->y = randFloat() * 2.0f - 1.0f;
-        }
-    } else if (mode == 2) {
-        for (int i = 0; i < system->n; i++) {
-            Particle *particle = &system->particles[i];
-            float angle = randFloat() * 2.0f * M_PI;
-            float radius = randFloat() * randFloat() * 0.3;
-            particle->x = cos(angle) * radius;
-            particle->y = sin(angle) * radius;
+void *simThreadMain(void *arg) {
+    SimThread *sim = (SimThread *) arg;
+    // the simulation takes the place of the main thread in the thread pool
+    if (sim->system->threads->pin) pinCurrentThread(0);
+    struct timespec t, last;
+    startTimer(&last);
+    while (true) {
+        while (atomic_load(&sim->waiting)) sched_yield();
+        pthread_mutex_lock(&sim->lock);
+        if (sim->quit) {
+            pthread_mutex_unlock(&sim->lock);
+            break;
         }
-    } else if (mode == 3) {
-        for (int i = 0; i < system->n; i++) {
-            Particle *particle = &system->particles[i];
-            particle->x = randFloat() * 2.0f - 1.0f;
-            particle->y = (randFloat() - 0.5) * 0.2 * randFloat();
-        }
-    } else if (mode == 4) {
-        for (int i = 0; i < system->n; i++) {
-            Particle *particle = &system->particles[i];
-            float angle = randFloat() * 2.0f * M_PI;
-            float radius = 0.1f + angle * 0.1f;
-            particle->x = cos(angle) * radius;
-            particle->y = sin(angle) * radius;
+        if (*sim->pause) {
+            pthread_mutex_unlock(&sim->lock);
+            usleep(5000);
+            startTimer(&last);
+            continue;
         }
+        int steps = *sim->stepsPerFrame;
+        startTimer(&t);
+        simulate(sim->system, sim->domain, sim->tuner, sim->recorder, steps);
+        sim->msPerUpdate = stopTimer(&t) / (double) steps;
+        checkpointSteps(sim->checkpointer, sim->system, steps);
+        rewindSteps(sim->rewind, sim->system, steps);
+        sim->stepsPerSecond = 1000.0 * steps / stopTimer(&last);
+        publishSnapshot(sim);
+        pthread_mutex_unlock(&sim->lock);
     }
+    return NULL;
 }
 
-double diffMs(struct timespec *start, struct timespec *end) {
-    // in ms
-    return (((double) (end->tv_sec - start->tv_sec)) * 1000.0 +
-            ((double) (end->tv_nsec - start->tv_nsec)) / 1000000.0);
+SimThread *startSimThread(ParticleSystem *system, Domain *domain, Autotuner *tuner, Recorder *recorder,
+        Checkpointer *checkpointer, Rewind *rewind, int *stepsPerFrame, bool *pause) {
+    SimThread *sim = calloc(1, sizeof(SimThread));
+    sim->system = system;
+    sim->domain = domain;
+    sim->tuner = tuner;
+    sim->recorder = recorder;
+    sim->checkpointer = checkpointer;
+    sim->rewind = rewind;
+    sim->stepsPerFrame = stepsPerFrame;
+    sim->pause = pause;
+    sim->view = *system;
+    sim->view.gridCurrent = false;  // the snapshots have no cells
+    sim->back = 0;
+    atomic_init(&sim->middle, 1);
+    sim->front = 2;
+    atomic_init(&sim->waiting, 0);
+    pthread_mutex_init(&sim->lock, NULL);
+
+    // the first frame shows the current state
+    double stepsPerSecond, msPerUpdate;
+    publishSnapshot(sim);
+    acquireSnapshot(sim, &stepsPerSecond, &msPerUpdate);
+    if (system->threads->pin) {
+        // the GUI moves out of the way, onto the CPU after the thread pool
+        pinCurrentThread(system->threads->numThreads);
+    }
+    if (pthread_create(&sim->thread, NULL, simThreadMain, sim) != 0) {
+        fprintf(stderr, "could not start the simulation thread\n");
+        for (int i = 0; i < 3; i++) free(sim->slots[i].particles);
+        pthread_mutex_destroy(&sim->lock);
+        free(sim);
+        return NULL;
+    }
+    return sim;
 }
 
-void startTimer(struct timespec *t) {
-    clock_gettime(CLOCK_MONOTONIC, t);
+void lockSimThread(SimThread *sim) {
+    // the simulation pauses after its current frame
+    atomic_store(&sim->waiting, 1);
+    pthread_mutex_lock(&sim->lock);
 }
 
-double stopTimer(struct timespec *t) {
-    // after this call, t contains the current time
-    struct timespec t0 = *t;
-    clock_gettime(CLOCK_MONOTONIC, t);
-    return diffMs(&t0, t);
+void unlockSimThread(SimThread *sim) {
+    // changes made while locked are shown right away, also when paused
+    publishSnapshot(sim);
+    pthread_mutex_unlock(&sim->lock);
+    atomic_store(&sim->waiting, 0);
+}
+
+void stopSimThread(SimThread *sim) {
+    if (sim == NULL) return;
+    lockSimThread(sim);
+    sim->quit = true;
+    pthread_mutex_unlock(&sim->lock);
+    atomic_store(&sim->waiting, 0);
+    pthread_join(sim->thread, NULL);
+    pthread_mutex_destroy(&sim->lock);
+    for (int i = 0; i < 3; i++) free(sim->slots[i].particles);
+    free(sim);
+}
+#else
+typedef struct {
+    ParticleSystem view;
+    SimStats stats;
+} SimThread;
+
+SimThread *startSimThread(ParticleSystem *system, Domain *domain, Autotuner *tuner, Recorder *recorder,
+        Checkpointer *checkpointer, Rewind *rewind, int *stepsPerFrame, bool *pause) {
+    fprintf(stderr, "a separate simulation thread is not supported on this platform\n");
+    return NULL;
+}
+
+bool acquireSnapshot(SimThread *sim, double *stepsPerSecond, double *msPerUpdate) { return false; }
+void lockSimThread(SimThread *sim) {}
+void unlockSimThread(SimThread *sim) {}
+void stopSimThread(SimThread *sim) {}
+#endif
+
+bool commandChangesSystem(int ch, char waitingCommand) {
+    // keys that change the system or what the simulation reads, unlike zoom, panning and the windows
+    if (ch == '\r' || ch == '\n') return waitingCommand != 0 && strchr("trknm", waitingCommand) != NULL;
+    if (waitingCommand == 'x' || ch <= 0 || ch > 255) return false;
+    if (ch == waitingCommand && (ch == 'p' || ch == 'a')) return true;  // double tap
+    if (ch >= '0' && ch <= '9' && (waitingCommand == 'p' || waitingCommand == 'a')) return true;
+    return strchr(" bBfFSL", ch) != NULL;
 }
 
 void colorIf(bool val, WINDOW *win) {
@@ -497,9 +5401,20 @@ int main(int argc, char *argv[]) {
     system.dt = DEFAULT_DT;
     system.n = DEFAULT_N;
     system.m = DEFAULT_M;
+    system.cellDivisor = 1;
+    system.reorderInterval = 0;
+    system.stepsSinceReorder = 0;
+    system.layoutVersion = 0;
+    system.ghostCells = false;
+    system.accuracy = ACCURACY_EXACT;
+    system.matrixFormat = DEFAULT_MATRIX_FORMAT;
+    system.numFamilies = DEFAULT_FAMILIES;
+    system.rank = DEFAULT_RANK;
 
     // UiSettings defaults
     UiSettings ui;
+    ui.rawFrames = false;
+    memset(&ui.text, 0, sizeof(ui.text));
     ui.printInPlace = false;
     ui.printInPlaceIsFirstFrame = true;
     ui.w = DEFAULT_W;
@@ -508,16 +5423,133 @@ int main(int argc, char *argv[]) {
     ui.shiftX = 0.0f;
     ui.shiftY = 0.0f;
     ui.pause = false;
-    ui.densityChars = (char*) malloc(sizeof(char) * ((size_t) MAX_WAIT_ARG_LEN + 1));
-    strcpy(ui.densityChars, DEFAULT_DENSITY_CHARS);
+    ui.densityChars = strdup(DEFAULT_DENSITY_CHARS);
     ui.showInfo = false;
     ui.showDebug = false;
     ui.clear = true;
     ui.colorMode = DEFAULT_COLOR_MODE;
 
     // process command line arguments
+    char *forceExpr = NULL;
+    char *loadPath = NULL;
+    char *savePath = NULL;
+    bool useWarmupCache = true;
+    char *recordPath = NULL;
+    int recordEvery = 1;
+    bool recordVelocities = false;
+    Domain domain;
+    domain.numWorkers = 1;
+    int numThreads = 1;
+    bool pin = false;
+    int hugePages = HUGE_PAGES_OFF;
+    Autotuner tuner;
+    tuner.enabled = false;
+    tuner.trial = -1;
+    tuner.stepsUntilRound = 1;  // first round right away
+    tuner.currentMs = 0;
+    Checkpointer checkpointer;
+    memset(&checkpointer, 0, sizeof(checkpointer));
+    Rewind rewind;
+    memset(&rewind, 0, sizeof(rewind));
+    rewind.every = DEFAULT_REWIND_EVERY;
+    int rewindMegabytes = 0;
+    char *replayPath = NULL;
+    Replay replay;
+    char *exportDir = NULL;
+    char *imageSize = strdup(DEFAULT_IMAGE_SIZE);
+    int imageFormat = IMAGE_FORMAT_PNG;
+    int exportFrames = 0;
+    bool directOutput = false;
+    bool simThreaded = false;
+    Matrix matrix = {0, NULL};
+    char *settingsPath = NULL;
+    char *saveSettingsPath = NULL;
+    bool watchSettings = false;
+    bool zoomGiven = false;
+
+    // the variables set by settings files, "live" ones also by --watch-settings
+    Setting settings[] = {
+        {"n", SETTING_INT, &system.n, NULL, true, 1, INT_MAX},
+        {"m", SETTING_INT, &system.m, NULL, true, 1, INT_MAX},
+        {"attraction-mode", SETTING_INT, &matrixMode, NULL, false, 1, NUM_MATRIX_MODES},
+        {"matrix-format", SETTING_INT, &system.matrixFormat, NULL, false, 0, NUM_MATRIX_FORMATS},
+        {"families", SETTING_INT, &system.numFamilies, NULL, false, 1, INT_MAX},
+        {"rank", SETTING_INT, &system.rank, NULL, false, 1, INT_MAX},
+        {"rmax", SETTING_FLOAT, &system.rMax, NULL, true, FLT_MIN, FLT_MAX},
+        {"dt", SETTING_FLOAT, &system.dt, NULL, true, 0, FLT_MAX},
+        {"friction-half-life", SETTING_FLOAT, &system.frictionHalfLife, NULL, true, FLT_MIN, FLT_MAX},
+        {"force-factor", SETTING_FLOAT, &system.forceFactor, NULL, true, -FLT_MAX, FLT_MAX},
+        {"position-mode", SETTING_INT, &positionMode, NULL, false, 1, NUM_POSITION_MODES},
+        {"seed", SETTING_INT, &seed, &useSeed, false, 0, INT_MAX},
+        {"steps-per-frame", SETTING_INT, &stepsPerFrame, NULL, true, 1, INT_MAX},
+        {"skip-frames", SETTING_INT, &initialSkipFrames, NULL, false, 0, INT_MAX},
+        {"zoom", SETTING_FLOAT, &ui.zoom, &zoomGiven, true, FLT_MIN, FLT_MAX},
+        {"chars", SETTING_STRING, &ui.densityChars, NULL, false, 1, MAX_WAIT_ARG_LEN},
+        {"color-mode", SETTING_INT, &ui.colorMode, NULL, true, 0, NUM_COLOR_MODES},
+        {"clear", SETTING_BOOL, &ui.clear, NULL, false, 0, 1},
+        {"paused", SETTING_BOOL, &ui.pause, NULL, false, 0, 1},
+        {"info", SETTING_BOOL, &ui.showInfo, NULL, false, 0, 1},
+        {"width", SETTING_INT, &ui.w, NULL, false, 1, INT_MAX},
+        {"height", SETTING_INT, &ui.h, NULL, false, 1, INT_MAX},
+        {"force-expr", SETTING_STRING, &forceExpr, NULL, false, 1, INT_MAX},
+        {"procs", SETTING_INT, &domain.numWorkers, NULL, false, 1, INT_MAX},
+        {"threads", SETTING_INT, &numThreads, NULL, false, 1, INT_MAX},
+        {"pin", SETTING_BOOL, &pin, NULL, false, 0, 1},
+        {"hugepages", SETTING_INT, &hugePages, NULL, false, HUGE_PAGES_OFF, HUGE_PAGES_EXPLICIT},
+        {"autotune", SETTING_BOOL, &tuner.enabled, NULL, false, 0, 1},
+        {"cell-divisor", SETTING_INT, &system.cellDivisor, NULL, false, 1, MAX_CELL_DIVISOR},
+        {"reorder", SETTING_INT, &system.reorderInterval, NULL, false, 0, INT_MAX},
+        {"ghost-cells", SETTING_BOOL, &system.ghostCells, NULL, false, 0, 1},
+        {"accuracy", SETTING_INT, &system.accuracy, NULL, false, ACCURACY_EXACT, ACCURACY_FAST},
+        {"record-every", SETTING_INT, &recordEvery, NULL, false, 1, INT_MAX},
+        {"record-velocities", SETTING_BOOL, &recordVelocities, NULL, false, 0, 1},
+        {"checkpoint-every", SETTING_INT, &checkpointer.every, NULL, false, 0, INT_MAX},
+        {"rewind", SETTING_INT, &rewindMegabytes, NULL, false, 0, INT_MAX},
+        {"rewind-every", SETTING_INT, &rewind.every, NULL, false, 1, INT_MAX},
+        {"image-size", SETTING_STRING, &imageSize, NULL, false, 3, INT_MAX},
+        {"image-format", SETTING_INT, &imageFormat, NULL, false, IMAGE_FORMAT_PPM, IMAGE_FORMAT_PNG},
+        {"direct", SETTING_BOOL, &directOutput, NULL, false, 0, 1},
+        {"sim-thread", SETTING_BOOL, &simThreaded, NULL, false, 0, 1},
+    };
+    int numSettings = sizeof(settings) / sizeof(settings[0]);
+
+    struct option longOptions[] = {
+        {"force-expr", required_argument, NULL, OPT_FORCE_EXPR},
+        {"procs", required_argument, NULL, OPT_PROCS},
+        {"threads", required_argument, NULL, OPT_THREADS},
+        {"pin", no_argument, NULL, OPT_PIN},
+        {"hugepages", required_argument, NULL, OPT_HUGEPAGES},
+        {"autotune", no_argument, NULL, OPT_AUTOTUNE},
+        {"cell-divisor", required_argument, NULL, OPT_CELL_DIVISOR},
+        {"reorder", required_argument, NULL, OPT_REORDER},
+        {"ghost-cells", no_argument, NULL, OPT_GHOST_CELLS},
+        {"accuracy", required_argument, NULL, OPT_ACCURACY},
+        {"load", required_argument, NULL, OPT_LOAD},
+        {"save", required_argument, NULL, OPT_SAVE},
+        {"no-cache", no_argument, NULL, OPT_NO_CACHE},
+        {"record", required_argument, NULL, OPT_RECORD},
+        {"record-every", required_argument, NULL, OPT_RECORD_EVERY},
+        {"record-velocities", no_argument, NULL, OPT_RECORD_VELOCITIES},
+        {"read-record", required_argument, NULL, OPT_READ_RECORD},
+        {"settings", required_argument, NULL, OPT_SETTINGS},
+        {"save-settings", required_argument, NULL, OPT_SAVE_SETTINGS},
+        {"watch-settings", no_argument, NULL, OPT_WATCH_SETTINGS},
+        {"checkpoint-every", required_argument, NULL, OPT_CHECKPOINT_EVERY},
+        {"rewind", required_argument, NULL, OPT_REWIND},
+        {"rewind-every", required_argument, NULL, OPT_REWIND_EVERY},
+        {"replay", required_argument, NULL, OPT_REPLAY},
+        {"raw-frames", no_argument, NULL, OPT_RAW_FRAMES},
+        {"export-images", required_argument, NULL, OPT_EXPORT_IMAGES},
+        {"image-size", required_argument, NULL, OPT_IMAGE_SIZE},
+        {"image-format", required_argument, NULL, OPT_IMAGE_FORMAT},
+        {"export-frames", required_argument, NULL, OPT_EXPORT_FRAMES},
+        {"direct", no_argument, NULL, OPT_DIRECT},
+        {"sim-thread", no_argument, NULL, OPT_SIM_THREAD},
+        {NULL, 0, NULL, 0}
+    };
+
     int opt;
-    while ((opt = getopt(argc, argv, "n:m:a:A:r:t:z:x:p:c:s:W:H:k:K:dqoOizPh")) != -1) {
+    while ((opt = getopt_long(argc, argv, "n:m:a:A:F:f:R:r:t:z:x:p:c:s:W:H:k:K:dqoOizPh", longOptions, NULL)) != -1) {
         switch (opt) {
             case 'n':
                 system.n = atoi(optarg);
@@ -529,7 +5561,16 @@ int main(int argc, char *argv[]) {
                 matrixMode = atoi(optarg);
                 break;
             case 'A':
-                printf("option -A <matrix> not implemented yet\n");
+                if (!loadMatrixArgument(optarg, &matrix)) return 1;
+                break;
+            case 'F':
+                system.matrixFormat = atoi(optarg);
+                break;
+            case 'f':
+                system.numFamilies = atoi(optarg);
+                break;
+            case 'R':
+                system.rank = atoi(optarg);
                 break;
             case 'r':
                 system.rMax = atof(optarg);
@@ -544,7 +5585,8 @@ int main(int argc, char *argv[]) {
                 ui.pause = true;
                 break;
             case 'x':
-                strcpy(ui.densityChars, optarg);
+                free(ui.densityChars);
+                ui.densityChars = strdup(optarg);
                 break;
             case 'c':
                 ui.colorMode = atoi(optarg);
@@ -588,6 +5630,103 @@ int main(int argc, char *argv[]) {
             case 'K':
                 initialSkipFrames = atoi(optarg);
                 break;
+            case OPT_FORCE_EXPR:
+                free(forceExpr);
+                forceExpr = strdup(optarg);
+                break;
+            case OPT_PROCS:
+                domain.numWorkers = atoi(optarg);
+                break;
+            case OPT_THREADS:
+                numThreads = atoi(optarg);
+                break;
+            case OPT_PIN:
+                pin = true;
+                break;
+            case OPT_HUGEPAGES:
+                hugePages = atoi(optarg);
+                break;
+            case OPT_AUTOTUNE:
+                tuner.enabled = true;
+                break;
+            case OPT_CELL_DIVISOR:
+                system.cellDivisor = atoi(optarg);
+                break;
+            case OPT_REORDER:
+                system.reorderInterval = atoi(optarg);
+                break;
+            case OPT_GHOST_CELLS:
+                system.ghostCells = true;
+                break;
+            case OPT_ACCURACY:
+                system.accuracy = atoi(optarg);
+                break;
+            case OPT_LOAD:
+                loadPath = optarg;
+                break;
+            case OPT_SAVE:
+                savePath = optarg;
+                break;
+            case OPT_NO_CACHE:
+                useWarmupCache = false;
+                break;
+            case OPT_RECORD:
+                recordPath = optarg;
+                break;
+            case OPT_RECORD_EVERY:
+                recordEvery = atoi(optarg);
+                break;
+            case OPT_RECORD_VELOCITIES:
+                recordVelocities = true;
+                break;
+            case OPT_READ_RECORD:
+                return printRecord(optarg);
+            case OPT_SETTINGS:
+                settingsPath = optarg;
+                if (!loadSettings(settingsPath, settings, numSettings, &matrix, false)) return 1;
+                break;
+            case OPT_SAVE_SETTINGS:
+                saveSettingsPath = optarg;
+                break;
+            case OPT_WATCH_SETTINGS:
+                watchSettings = true;
+                break;
+            case OPT_CHECKPOINT_EVERY:
+                checkpointer.every = atoi(optarg);
+                break;
+            case OPT_REWIND:
+                rewindMegabytes = atoi(optarg);
+                break;
+            case OPT_REWIND_EVERY:
+                rewind.every = atoi(optarg);
+                break;
+            case OPT_REPLAY:
+                replayPath = optarg;
+                break;
+            case OPT_RAW_FRAMES:
+                ui.rawFrames = true;
+                showGui = false;
+                break;
+            case OPT_EXPORT_IMAGES:
+                exportDir = optarg;
+                showGui = false;
+                break;
+            case OPT_IMAGE_SIZE:
+                free(imageSize);
+                imageSize = strdup(optarg);
+                break;
+            case OPT_IMAGE_FORMAT:
+                imageFormat = atoi(optarg);
+                break;
+            case OPT_EXPORT_FRAMES:
+                exportFrames = atoi(optarg);
+                break;
+            case OPT_DIRECT:
+                directOutput = true;
+                break;
+            case OPT_SIM_THREAD:
+                simThreaded = true;
+                break;
             case 'h':
                 print_help();
                 return EXIT_SUCCESS;
@@ -597,8 +5736,52 @@ int main(int argc, char *argv[]) {
         }
     }
 
+    if (zoomGiven) setZoomFit = false;
+
+    // the matrix and the loaded file determine the buffer sizes
+    if (matrix.values != NULL) system.m = matrix.m;
+    bool loadSnapshotFile = false;
+    if (loadPath != NULL) {
+        SnapshotHeader header;
+        int numTypes;
+        if (readSnapshotHeader(loadPath, &header)) {
+            loadSnapshotFile = true;
+            system.n = header.n;
+            system.m = header.m;
+            system.numFamilies = header.numFamilies;
+            system.rank = header.rank;
+            system.rMax = header.rMax;
+            system.dt = header.dt;
+        } else if (scanParticleFile(loadPath, &system.n, &numTypes)) {
+            if (numTypes > system.m && matrix.values == NULL) system.m = numTypes;
+        } else {
+            return 1;
+        }
+    }
+    if (replayPath != NULL) {
+        // no simulation, only buffers for the largest frame
+        if (!openReplay(&replay, replayPath)) return 1;
+        system.n = replay.maxN;
+        system.m = replay.header.m;
+        system.rMax = replay.header.rMax;
+        system.dt = replay.header.dt;
+        domain.numWorkers = 1;
+        tuner.enabled = false;
+        initialSkipFrames = 0;
+        rewindMegabytes = 0;
+        simThreaded = false;
+    }
+    if (matrix.values != NULL && matrix.m != system.m) {
+        printf("the matrix has %d colors, but %s has %d\n", matrix.m, loadPath, system.m);
+        return 1;
+    }
+
     // sanity checks
 
+    if (useSeed && (int) seed < 0) {
+        printf("seed must be non-negative\n");
+        return 1;
+    }
     if (system.n <= 0) {
         printf("n must be positive\n");
         return 1;
@@ -615,6 +5798,63 @@ int main(int argc, char *argv[]) {
         printf("dt must be non-negative\n");
         return 1;
     }
+    if (hugePages < HUGE_PAGES_OFF || hugePages > HUGE_PAGES_EXPLICIT) {
+        printf("huge page mode must be an integer between 0 and %d\n", HUGE_PAGES_EXPLICIT);
+        return 1;
+    }
+    if (system.cellDivisor < 1 || system.cellDivisor > MAX_CELL_DIVISOR) {
+        printf("cell divisor must be an integer between 1 and %d\n", MAX_CELL_DIVISOR);
+        return 1;
+    }
+    if (system.accuracy < ACCURACY_EXACT || system.accuracy > ACCURACY_FAST) {
+        printf("accuracy tier must be an integer between 0 and %d\n", ACCURACY_FAST);
+        return 1;
+    }
+    if (system.reorderInterval < 0) {
+        printf("reorder interval must be non-negative\n");
+        return 1;
+    }
+    if (recordEvery <= 0) {
+        printf("record interval must be positive\n");
+        return 1;
+    }
+    if (checkpointer.every < 0) {
+        printf("checkpoint interval must be non-negative\n");
+        return 1;
+    }
+    if (rewindMegabytes < 0) {
+        printf("rewind memory must be non-negative\n");
+        return 1;
+    }
+    if (rewind.every <= 0) {
+        printf("rewind interval must be positive\n");
+        return 1;
+    }
+    int imageW, imageH;
+    if (sscanf(imageSize, "%dx%d", &imageW, &imageH) != 2 || imageW <= 0 || imageH <= 0) {
+        printf("image size must be given as <width>x<height>\n");
+        return 1;
+    }
+    if (imageFormat != IMAGE_FORMAT_PPM && imageFormat != IMAGE_FORMAT_PNG) {
+        printf("image format must be %d or %d\n", IMAGE_FORMAT_PPM, IMAGE_FORMAT_PNG);
+        return 1;
+    }
+    if (exportFrames < 0) {
+        printf("number of exported frames must be non-negative\n");
+        return 1;
+    }
+    if (numThreads <= 0) {
+        printf("number of threads must be positive\n");
+        return 1;
+    }
+    if (domain.numWorkers <= 0) {
+        printf("number of processes must be positive\n");
+        return 1;
+    }
+    if (domain.numWorkers > 1 && system.rMax > 2.0f / domain.numWorkers) {
+        printf("rmax must not exceed the slab height 2/%d\n", domain.numWorkers);
+        return 1;
+    }
     if (positionMode < 1 || positionMode > NUM_POSITION_MODES) {
         printf("position mode must be an integer between 1 and %d\n", NUM_POSITION_MODES);
         return 1;
@@ -623,30 +5863,146 @@ int main(int argc, char *argv[]) {
         printf("matrix mode must be an integer between 1 and %d\n", NUM_MATRIX_MODES);
         return 1;
     }
+    if (system.matrixFormat < 0 || system.matrixFormat > NUM_MATRIX_FORMATS) {
+        printf("matrix format must be an integer between 0 and %d\n", NUM_MATRIX_FORMATS);
+        return 1;
+    }
+    if (system.numFamilies <= 0) {
+        printf("number of families must be positive\n");
+        return 1;
+    }
+    if (system.rank <= 0) {
+        printf("rank must be positive\n");
+        return 1;
+    }
     if (ui.colorMode < 0 || ui.colorMode > NUM_COLOR_MODES) {
         printf("color mode must be an integer between 0 and %d\n", NUM_COLOR_MODES);
         return 1;
     }
+    if (forceExpr != NULL && (system.matrixFormat > MATRIX_FORMAT_DENSE || system.accuracy != ACCURACY_EXACT
+            || system.ghostCells)) {
+        printf("--force-expr cannot be combined with matrix formats 2 to %d, accuracy tier %d or ghost cells\n",
+                NUM_MATRIX_FORMATS, ACCURACY_FAST);
+        return 1;
+    }
+    if (strlen(ui.densityChars) == 0 || strlen(ui.densityChars) > MAX_WAIT_ARG_LEN) {
+        printf("density characters must be 1 to %d characters\n", MAX_WAIT_ARG_LEN);
+        return 1;
+    }
 
     // ParticleSystem initialization
 
-    srand(useSeed ? seed : time(NULL));
+    rngSeed(&system.rng, useSeed ? seed : (uint64_t) time(NULL), 0);
+
+    Arena arena;
+    arenaInit(&arena, hugePages);
+    system.arena = &arena;
+
+    system.threads = startThreads(numThreads, pin);
+    system.capacity = system.n;
+    system.particles = arenaAlloc(&arena, system.n * sizeof(Particle), false);
+    system.gridMap = arenaAlloc(&arena, system.n * sizeof(int), false);
+    system.spareParticles = NULL;
+    if (system.reorderInterval > 0 || tuner.enabled) {
+        system.spareParticles = arenaAlloc(&arena, system.n * sizeof(Particle), false);
+    }
+    system.ghostParticles = NULL;
+    if (system.ghostCells) {
+        system.ghostParticles = arenaAlloc(&arena, 4 * system.n * sizeof(Particle), false);
+    }
+    runJob(system.threads, firstTouchJob, &system);
+    system.gridCapacity = 0;
+    system.grid = NULL;
+    system.cellTypesCapacity = 0;
+    system.cellTypes = NULL;
+    system.cellTypesWanted = false;
+    system.cellTypesCurrent = false;
+    system.ghostGridCapacity = 0;
+    system.ghostGrid = NULL;
+    resizeGrid(&system);
+
+    // worker processes must see matrix changes made by this process
+    bool sharedMatrix = domain.numWorkers > 1;
+    int m = system.m;
+    system.typeCapacity = m;
+    if (system.numFamilies > m) system.numFamilies = m;
+    if (system.rank > m) system.rank = m;
+    system.matrix = arenaAlloc(&arena, m * m * sizeof(float), sharedMatrix);
+    system.family = arenaAlloc(&arena, m * sizeof(int), sharedMatrix);
+    for (int i = 0; i < m; i++) {
+        // contiguous families of (almost) equal size
+        system.family[i] = i * system.numFamilies / m;
+    }
+    system.blockMatrix = arenaAlloc(&arena, m * m * sizeof(float), sharedMatrix);
+    system.factorU = arenaAlloc(&arena, m * system.rank * sizeof(float), sharedMatrix);
+    system.factorV = arenaAlloc(&arena, m * system.rank * sizeof(float), sharedMatrix);
+    system.quantMatrix = arenaAlloc(&arena, m * m * sizeof(signed char), sharedMatrix);
+    system.quantScale = 1.0f;
+
+    system.forceKernel = NULL;
+    if (forceExpr != NULL) {
+        system.forceKernel = compileForceKernel(forceExpr);
+        if (system.forceKernel == NULL) {
+            fprintf(stderr, "falling back to the built-in force\n");
+        }
+    }
+
+    if (loadSnapshotFile) {
+        if (!loadSnapshot(&system, loadPath)) return 1;
+        applyMatrix(&system, &matrix);
+    } else {
+        // drawn even if replaced, so that the seed gives the same particles as without -A
+        randomizeMatrix(&system, matrixMode);
+        applyMatrix(&system, &matrix);
+        if (loadPath != NULL) {
+            if (!loadParticleFile(&system, loadPath)) return 1;
+        } else {
+            initTypes(&system);
+            initPositions(&system, positionMode);
+        }
+    }
+
+    if (replayPath != NULL) {
+        seekReplay(&replay, &system, replay.step);
+    }
 
-    system.particles = malloc(system.n * sizeof(Particle));
-    system.gridSize = (int) floor(2.0f / system.rMax);
-    system.grid = (int *) malloc((system.gridSize * system.gridSize + 1) * sizeof(int));
-    system.gridMap = malloc(system.n * sizeof(int));
-    system.matrix = malloc(system.m * system.m * sizeof(float));
+    // the state after -K frames is cached for reproducible runs. not with trails (-d),
+    // which would include the skipped frames, or with autotuning, which is not reproducible.
+    char warmupPath[1100] = "";
+    char warmupDir[1024];
+    if (useWarmupCache && useSeed && initialSkipFrames > 0 && loadPath == NULL && ui.clear && !tuner.enabled
+            && cacheDirectory(warmupDir, sizeof(warmupDir))) {
+        // numbers only, the force expression of any length is hashed after them
+        char key[512];
+        snprintf(key, sizeof(key),
+                "v%d s%u n%d m%d a%d A%016llx F%d f%d R%d p%d r%.9g t%.9g h%.9g x%.9g k%d K%d c%d o%d g%d y%d P%d e",
+                SNAPSHOT_VERSION, seed, system.n, system.m, matrixMode,
+                matrix.values != NULL ? hashBytes(matrix.values, (size_t) matrix.m * matrix.m * sizeof(float),
+                        14695981039346656037ULL) : 0ULL,
+                system.matrixFormat, system.numFamilies, system.rank, positionMode, system.rMax, system.dt,
+                system.frictionHalfLife, system.forceFactor, stepsPerFrame, initialSkipFrames,
+                system.cellDivisor, system.reorderInterval, system.ghostCells, system.accuracy,
+                domain.numWorkers);
+        unsigned long long hash = hashString(key, 14695981039346656037ULL);
+        if (forceExpr != NULL) hash = hashString(forceExpr, hash);
+        snprintf(warmupPath, sizeof(warmupPath), "%s/warmup-%016llx.snap", warmupDir, hash);
+        SnapshotHeader header;
+        if (readSnapshotHeader(warmupPath, &header) && loadSnapshot(&system, warmupPath)) {
+            initialSkipFrames = 0;
+            warmupPath[0] = '\0';  // nothing to save
+        }
+    }
 
-    randomizeMatrix(&system, matrixMode);
+    if (numThreads > 1 || pin) {
+        printPlacement(&system);
+    }
 
-    for (int i=0; i<system.n; i++) {
-        Particle *particle = &system.particles[i];
-        particle->type = rand() % system.m;
-        particle->vx = 0.0f;
-        particle->vy = 0.0f;
+    if (domain.numWorkers > 1 && !domainStart(&domain, &system, pin)) {
+        return 1;
     }
-    initPositions(&system, positionMode);
+    // the workers use their own settings
+    if (domain.numWorkers > 1) tuner.enabled = false;
+    tuner.current = getEngineConfig(&system);
 
     // UI initialization
 
@@ -656,7 +6012,8 @@ int main(int argc, char *argv[]) {
     WINDOW *win;          // for particle visualization
     WINDOW *infoWin;      // for info text
     WINDOW *debugWin;     // for debug info
-    int *densityGridBuf;  // for density counting
+    DirectScreen direct;  // for --direct
+    DensityGrid densityGrid;  // for density counting
 
     if (showGui) {
         initscr();
@@ -683,10 +6040,19 @@ int main(int argc, char *argv[]) {
 
         // allocate GUI buffers
         win = newwin(ui.h, ui.w, 0, 0);
-        infoWin = newwin(12, 32, 0, 0);
-        debugWin = newwin(8, 32, ui.h - 8, 0);
+        // cut off on small terminals, newwin() fails for windows that do not fit
+        int panelW = ui.w < 32 ? ui.w : 32;
+        int infoH = ui.h < 13 ? ui.h : 13;
+        int debugH = ui.h < 15 ? ui.h : 15;
+        infoWin = newwin(infoH, panelW, 0, 0);
+        debugWin = newwin(debugH, panelW, ui.h - debugH, 0);
+        if (directOutput) {
+            // clear the screen once, curses never draws again
+            refresh();
+            startDirectScreen(&direct, ui.w, ui.h);
+        }
     }
-    densityGridBuf = calloc(ui.w * ui.h * system.m, sizeof(int));
+    allocDensityGrid(&densityGrid, &arena, ui.w, ui.h, system.m);
 
     if (setZoomFit) {
         ui.zoom = (float) ui.w / ((float) ui.h * CHAR_RATIO);
@@ -700,36 +6066,107 @@ int main(int argc, char *argv[]) {
     double msPerRender = 0;
     double msPerCopywin = 0;
     double msPerInputHandling = 0;
+    double stepsPerSecond = 0;  // measured by the simulation thread
 
-    renderDensity(densityGridBuf, ui.w, ui.h, &system, ui.zoom, ui.shiftX, ui.shiftY, ui.clear);
+    renderDensity(&densityGrid, &system, ui.zoom, ui.shiftX, ui.shiftY, ui.clear);
 
     for (int i=0; i<initialSkipFrames; i++) {
-        for (int j=0; j<stepsPerFrame; j++) {
-            update(&system);
+        simulate(&system, &domain, &tuner, NULL, stepsPerFrame);
+        // skipped frames are only visible as trails
+        if (!ui.clear) {
+            renderDensity(&densityGrid, &system, ui.zoom, ui.shiftX, ui.shiftY, ui.clear);
         }
-        renderDensity(densityGridBuf, ui.w, ui.h, &system, ui.zoom, ui.shiftX, ui.shiftY, ui.clear);
+    }
+    if (warmupPath[0] != '\0') {
+        saveSnapshot(&system, warmupPath);
     }
 
+    // the recording starts with the first shown frame
+    int exitStatus = 0;     // nonzero skips the main loop, but not the shutdown
+    Recorder *recorder = NULL;
+    if (recordPath != NULL) {
+        recorder = startRecording(&system, recordPath, recordEvery, recordVelocities, !showGui);
+        if (recorder == NULL) exitStatus = 1;
+    }
+
+    checkpointer.base = savePath != NULL ? savePath : DEFAULT_SAVE_FILE;
+    // rewinding is interactive
+    rewind.budget = showGui ? (size_t) rewindMegabytes * 1048576 : 0;
+    if (rewind.budget > 0) addRewindEntry(&rewind, &system);
+    ImageExporter *exporter = NULL;
+    if (exportDir != NULL) {
+        exporter = startImageExport(exportDir, imageFormat, imageW, imageH, ui.colorMode != 0);
+    }
     bool loop = !quitAfterOneFrame;
+    if (!showGui) {
+        // finish the files and print the statistics on Ctrl-C
+        signal(SIGINT, requestQuit);
+        signal(SIGTERM, requestQuit);
+#ifdef __unix__
+        // a reader closing the pipe ends the output (EPIPE), instead of killing the process
+        signal(SIGPIPE, SIG_IGN);
+#endif
+    }
+    uint64_t rawFrames = 0;     // written with --raw-frames
+    long long settingsModified = (settingsPath != NULL) ? fileModified(settingsPath) : 0;
+    // the text outputs keep every frame, so only the GUI gets a simulation thread
+    SimThread *simThread = NULL;
+    if (simThreaded && showGui) {
+        simThread = startSimThread(&system, &domain, &tuner, recorder, &checkpointer, &rewind,
+                &stepsPerFrame, &ui.pause);
+    }
 
     // MAIN LOOP
-    do {
+    while (exitStatus == 0) {
         startTimer(&t0);
+        bool fresh = true;          // a new state to show
+        bool simLocked = false;     // the simulation thread waits for changes to the system
 
         // PHYSICS UPDATE
-        if (!ui.pause) {
-            startTimer(&t);
-            for (int i=0; i<stepsPerFrame; i++) {
-                update(&system);
+        if (simThread != NULL) {
+            fresh = acquireSnapshot(simThread, &stepsPerSecond, &msPerUpdate);
+        } else if (replayPath != NULL) {
+            if (!ui.pause && !seekReplay(&replay, &system, replay.step + stepsPerFrame)) {
+                // the end of the recording
+                if (showGui) ui.pause = true; else loop = false;
             }
+        } else if (!ui.pause) {
+            startTimer(&t);
+            simulate(&system, &domain, &tuner, recorder, stepsPerFrame);
             msPerUpdate = stopTimer(&t) / (double) stepsPerFrame;
+            checkpointSteps(&checkpointer, &system, stepsPerFrame);
+            rewindSteps(&rewind, &system, stepsPerFrame);
+        }
+        ParticleSystem *shown = simThread != NULL ? &simThread->view : &system;
+        if (shown->m != densityGrid.m) {
+            // the number of types changed, resize outside of the hot path
+            releaseDensityGrid(&densityGrid, &arena);
+            allocDensityGrid(&densityGrid, &arena, ui.w, ui.h, shown->m);
+            if (showGui && has_colors()) {
+                for (int i = 0; i < shown->m; i++) {
+                    init_pair(i + 1, COLOR_RED + i, -1);
+                }
+            }
+        }
+        // trails count every state once, a cleared grid can show the same state again
+        if (fresh || ui.clear) {
+            renderDensity(&densityGrid, shown, ui.zoom, ui.shiftX, ui.shiftY, ui.clear);
         }
-        renderDensity(densityGridBuf, ui.w, ui.h, &system, ui.zoom, ui.shiftX, ui.shiftY, ui.clear);
 
         if (showGui) {
             startTimer(&t);
-            renderTerminal(&system, &ui, win, densityGridBuf);
+            if (directOutput) {
+                densityCells(&ui, &densityGrid, direct.cells, ui.colorMode == 1 && has_colors());
+            } else {
+                renderTerminal(&ui, win, &densityGrid);
+            }
             msPerRender = stopTimer(&t);
+            // with a simulation thread, the updates don't take time from the frames
+            double msPerShownFrame = msPerInputHandling + msPerRender + (simThread != NULL ? 0 : msPerUpdate);
+            // a simulation thread changes these while running, the windows show its latest snapshot
+            SimStats ownStats;
+            if (simThread == NULL) collectSimStats(&ownStats, &system, &tuner, &rewind, &checkpointer, recorder);
+            SimStats *stats = simThread != NULL ? &simThread->stats : &ownStats;
             if (ui.showInfo) {
                 box(infoWin, 0, 0);
                 int y = 0;
@@ -738,28 +6175,28 @@ int main(int argc, char *argv[]) {
                 mvwprintw(infoWin, y, 14, "INFO [i]");
                 y++;
                 colorIf(' '==waitingCommand, infoWin);
-                mvwprintw(infoWin, y, x, "%-16s %3s %7.0f", "FPS", "", 1000.0 / (msPerInputHandling + msPerUpdate + msPerRender));
+                mvwprintw(infoWin, y, x, "%-16s %3s %7.0f", "FPS", "", 1000.0 / msPerShownFrame);
                 y++;
                 colorIf('n'==waitingCommand, infoWin);
-                mvwprintw(infoWin, y, x, "%-16s %3s %7d", "num. particles", "[n]", system.n);
+                mvwprintw(infoWin, y, x, "%-16s %3s %7d", "num. particles", "[n]", stats->n);
                 y++;
                 colorIf('p'==waitingCommand, infoWin);
                 mvwprintw(infoWin, y, x, "%-16s %3s %5d/%d", "position mode", "[p]", positionMode, NUM_POSITION_MODES);
                 y++;
                 colorIf('m'==waitingCommand, infoWin);
-                mvwprintw(infoWin, y, x, "%-16s %3s %7d", "num. colors", "[m]", system.m);
+                mvwprintw(infoWin, y, x, "%-16s %3s %7d", "num. colors", "[m]", stats->m);
                 y++;
                 colorIf('a'==waitingCommand, infoWin);
                 mvwprintw(infoWin, y, x, "%-16s %3s %5d/%d", "attraction mode", "[a]", matrixMode, NUM_MATRIX_MODES);
                 y++;
                 colorIf('t'==waitingCommand, infoWin);
-                mvwprintw(infoWin, y, x, "%-16s %3s %7.4f", "dt (seconds)", "[t]", system.dt);
+                mvwprintw(infoWin, y, x, "%-16s %3s %7.4f", "dt (seconds)", "[t]", stats->dt);
                 y++;
                 colorIf('k'==waitingCommand, infoWin);
                 mvwprintw(infoWin, y, x, "%-16s %3s %7d", "steps per frame", "[k]", stepsPerFrame);
                 y++;
                 colorIf('r'==waitingCommand, infoWin);
-                mvwprintw(infoWin, y, x, "%-16s %3s %7.4f", "rmax", "[r]", system.rMax);
+                mvwprintw(infoWin, y, x, "%-16s %3s %7.4f", "rmax", "[r]", stats->rMax);
                 y++;
                 colorIf('x'==waitingCommand, infoWin);
                 mvwprintw(infoWin, y, x, "%-16s %3s %7s", "chars", "[x]", ui.densityChars);
@@ -768,6 +6205,15 @@ int main(int argc, char *argv[]) {
                 mvwprintw(infoWin, y, x, "%-16s %3s %5d/%d", "color mode", "[c]", ui.colorMode, NUM_COLOR_MODES);
                 y++;
                 colorIf(' '==waitingCommand, infoWin);
+                if (replayPath != NULL) {
+                    mvwprintw(infoWin, y, x, "%-16s %3s %7lld", "replay step", "[b]", replay.step);
+                } else if (rewind.budget > 0) {
+                    mvwprintw(infoWin, y, x, "%-16s %3s %7.1f", "rewind (MB)", "[b]", stats->rewindUsed / 1048576.0);
+                } else {
+                    mvwprintw(infoWin, y, x, "%-16s %3s %7s", "rewind (MB)", "[b]", "off");
+                }
+                y++;
+                colorIf(' '==waitingCommand, infoWin);
                 mvwprintw(infoWin, y, 9, " github/tom-mohr ");
             }
             if (ui.showDebug) {
@@ -776,7 +6222,7 @@ int main(int argc, char *argv[]) {
                 int x = 2;
                 mvwprintw(debugWin, y, 13, "DEBUG [I]");
                 y++;
-                mvwprintw(debugWin, y, x, "%-16s     %7.2f", "frame", msPerInputHandling + msPerUpdate + msPerRender);
+                mvwprintw(debugWin, y, x, "%-16s     %7.2f", "frame", msPerShownFrame);
                 y++;
                 mvwprintw(debugWin, y, x, "%-16s     %7.2f", "input handling", msPerInputHandling);
                 y++;
@@ -788,25 +6234,71 @@ int main(int argc, char *argv[]) {
                 y++;
                 mvwprintw(debugWin, y, x, "%-16s     %7.2f", "refresh", msPerRefresh);
                 y++;
+                double framesPerSecond = msPerFrame > 0 ? 1000.0 / msPerFrame : 0.0;
+                if (simThread == NULL) stepsPerSecond = stepsPerFrame * framesPerSecond;
+                mvwprintw(debugWin, y, x, "%-16s     %7.0f", "sim steps/s", ui.pause ? 0.0 : stepsPerSecond);
+                y++;
+                mvwprintw(debugWin, y, x, "%-16s     %7.0f", "render fps", framesPerSecond);
+                y++;
+                mvwprintw(debugWin, y, x, "%-16s     %7.1f", "memory (MB)", stats->memory / 1048576.0);
+                y++;
+                mvwprintw(debugWin, y, x, "%-16s %2dT /%d R%-3d", tuner.enabled ? "engine (tuned)" : "engine",
+                        stats->engine.threads, stats->engine.cellDivisor, stats->engine.reorderInterval);
+                y++;
+                if (tuner.enabled && stats->tuningTrial >= 0) {
+                    mvwprintw(debugWin, y, x, "%-16s     %3d/%-3d", "tuning", stats->tuningTrial + 1,
+                            stats->tuningCandidates);
+                } else if (tuner.enabled) {
+                    mvwprintw(debugWin, y, x, "%-16s     %7.3f", "tuned step", stats->tunedMs);
+                }
+                y++;
+                if (checkpointer.every > 0) {
+                    mvwprintw(debugWin, y, x, "%-16s     %7.2f", "checkpoint stall", stats->checkpointStallMs);
+                }
+                y++;
+                if (recorder != NULL) {
+                    mvwprintw(debugWin, y, x, "%-16s     %7llu", "frames dropped", stats->recordDropped);
+                }
+                y++;
             }
 
             // draw all windows onto terminal screen
             startTimer(&t);
-            overwrite(win, stdscr);
-            if (ui.showInfo) overwrite(infoWin, stdscr);
-            if (ui.showDebug) overwrite(debugWin, stdscr);
-            if (waitingCommand != 0) {
-                mvprintw(ui.h - 1, ui.w - 1 - (1 + 1 + MAX_WAIT_ARG_LEN + 1),
-                        "%c %s%c", waitingCommand, waitingCommandArg, (t.tv_sec % 2) ? '_' : ' ');
+            if (directOutput) {
+                if (ui.showInfo) overlayWindow(&direct, infoWin);
+                if (ui.showDebug) overlayWindow(&direct, debugWin);
+                if (waitingCommand != 0) {
+                    char prompt[1 + 1 + MAX_WAIT_ARG_LEN + 1 + 1];
+                    snprintf(prompt, sizeof(prompt), "%c %s%c", waitingCommand, waitingCommandArg, (t.tv_sec % 2) ? '_' : ' ');
+                    overlayString(&direct, ui.h - 1, ui.w - 1 - (1 + 1 + MAX_WAIT_ARG_LEN + 1), prompt);
+                }
+                msPerCopywin = stopTimer(&t);
+                flushDirectScreen(&direct);
+            } else {
+                overwrite(win, stdscr);
+                if (ui.showInfo) overwrite(infoWin, stdscr);
+                if (ui.showDebug) overwrite(debugWin, stdscr);
+                if (waitingCommand != 0) {
+                    mvprintw(ui.h - 1, ui.w - 1 - (1 + 1 + MAX_WAIT_ARG_LEN + 1),
+                            "%c %s%c", waitingCommand, waitingCommandArg, (t.tv_sec % 2) ? '_' : ' ');
+                }
+                msPerCopywin = stopTimer(&t);
+                refresh();
             }
-            msPerCopywin = stopTimer(&t);
-            refresh();
             msPerRefresh = stopTimer(&t);
 
             // napms(10);
 
             startTimer(&t);
+            // without a new state to show, wait for input instead of drawing the same frame again
+            if (simThread != NULL) timeout(fresh ? 0 : 5);
             int ch = getch();
+            if (!fresh && ch == ERR) startTimer(&t);  // only waited
+            if (simThread != NULL && commandChangesSystem(ch, waitingCommand)) {
+                // the simulation waits after its current frame
+                lockSimThread(simThread);
+                simLocked = true;
+            }
             // control commands (should always be accessible)
             switch (ch) {
                 case '\r':  // newline
@@ -823,7 +6315,12 @@ int main(int argc, char *argv[]) {
                             case 'r':
                                 if (strlen(waitingCommandArg) > 0) {
                                     // todo handle errors
-                                    system.rMax = atof(waitingCommandArg);
+                                    float rMax = atof(waitingCommandArg);
+                                    // halos only reach into neighbouring slabs
+                                    if (domain.numWorkers == 1 || rMax <= 2.0f / domain.numWorkers) {
+                                        system.rMax = rMax;
+                                        resizeGrid(&system);
+                                    }
                                 }
                                 break;
                             case 'z':
@@ -838,6 +6335,19 @@ int main(int argc, char *argv[]) {
                                     stepsPerFrame = atoi(waitingCommandArg);
                                 }
                                 break;
+                            case 'n':
+                                // worker processes and replays have fixed buffers
+                                if (strlen(waitingCommandArg) > 0 && domain.numWorkers == 1 && replayPath == NULL) {
+                                    int n = atoi(waitingCommandArg);
+                                    if (n > 0) setParticleCount(&system, n, positionMode);
+                                }
+                                break;
+                            case 'm':
+                                if (strlen(waitingCommandArg) > 0 && domain.numWorkers == 1 && replayPath == NULL) {
+                                    int newM = atoi(waitingCommandArg);
+                                    if (newM > 0 && newM != system.m) setTypeCount(&system, newM);
+                                }
+                                break;
                             case 'x':
                                 ;
                                 size_t len = strlen(waitingCommandArg);
@@ -912,6 +6422,8 @@ int main(int argc, char *argv[]) {
                     case 'r':
                     case 'z':
                     case 'k':
+                    case 'n':
+                    case 'm':
                     case 'x':
                     case 'p':
                     case 'a':
@@ -921,6 +6433,8 @@ int main(int argc, char *argv[]) {
                             switch (ch) {
                                 case 'p':
                                     initPositions(&system, positionMode);
+                                    if (domain.numWorkers > 1) domainScatter(&domain, &system);
+                                    clearRewind(&rewind);
                                     break;
                                 case 'a':
                                     randomizeMatrix(&system, matrixMode);
@@ -958,6 +6472,8 @@ int main(int argc, char *argv[]) {
                                 if (val >= 1 && val <= NUM_POSITION_MODES) {
                                     positionMode = val;
                                     initPositions(&system, val);
+                                    if (domain.numWorkers > 1) domainScatter(&domain, &system);
+                                    clearRewind(&rewind);
                                     waitingCommand = 0;  // success
                                 }
                                 break;
@@ -979,6 +6495,8 @@ int main(int argc, char *argv[]) {
                                 }
                                 break;
                             case 'k':
+                            case 'n':
+                            case 'm':
                                 if (ch == '.') break;
                             default:
                                 ;
@@ -1000,32 +6518,135 @@ int main(int argc, char *argv[]) {
                     case 'd':
                         ui.clear = !ui.clear;
                         break;
+                    case 'b':
+                    case 'B':
+                        // pause, so that repeated presses keep going back
+                        if (replayPath != NULL) {
+                            seekReplay(&replay, &system, replay.step - (ch == 'B' ? 10 : 1) * stepsPerFrame);
+                            ui.pause = true;
+                        } else if (rewindTo(&rewind, &system, &domain, rewind.step - (ch == 'B' ? 10 : 1) * stepsPerFrame)) {
+                            ui.pause = true;
+                        }
+                        break;
+                    case 'f':
+                    case 'F':
+                        if (replayPath != NULL) {
+                            seekReplay(&replay, &system, replay.step + (ch == 'F' ? 10 : 1) * stepsPerFrame);
+                            ui.pause = true;
+                        }
+                        break;
+                    case 'S':
+                        saveFile(&system, savePath != NULL ? savePath : DEFAULT_SAVE_FILE);
+                        if (saveSettingsPath != NULL) {
+                            saveSettings(saveSettingsPath, settings, numSettings, &system);
+                        }
+                        break;
+                    case 'L':
+                        // worker processes and replays have fixed buffers
+                        if (domain.numWorkers == 1 && replayPath == NULL) {
+                            const char *path = loadPath != NULL ? loadPath
+                                    : savePath != NULL ? savePath : DEFAULT_SAVE_FILE;
+                            SnapshotHeader header;
+                            if (readSnapshotHeader(path, &header)) {
+                                loadSnapshot(&system, path);
+                            } else {
+                                loadParticleFile(&system, path);
+                            }
+                            clearRewind(&rewind);
+                        }
+                        break;
                     default:
                         break;
                 }
             }
             msPerInputHandling = stopTimer(&t);
+        } else if (exporter != NULL) {
+            // no GUI -> images, rendered on their own (pixel) grid
+            exportImage(exporter, &system, setZoomFit ? (float) imageW / imageH : ui.zoom,
+                    ui.shiftX, ui.shiftY, ui.clear);
+            if (exportFrames > 0 && exporter->number >= (uint64_t) exportFrames) loop = false;
+        } else if (ui.rawFrames) {
+            // no GUI -> binary frames to stdout, until the reader goes away
+            if (!writeRawFrame(&ui, &densityGrid, rawFrames++)) loop = false;
         } else {
             // no GUI -> print to stdout
-            renderText(&system, &ui, densityGridBuf);
+            if (!renderText(&ui, &densityGrid)) loop = false;
+        }
+
+        if (watchSettings && settingsPath != NULL && fileModified(settingsPath) != settingsModified) {
+            // apply the live settings, invalid values are ignored
+            settingsModified = fileModified(settingsPath);
+            if (simThread != NULL && !simLocked) {
+                lockSimThread(simThread);
+                simLocked = true;
+            }
+            int n = system.n;
+            int m = system.m;
+            float rMax = system.rMax;
+            loadSettings(settingsPath, settings, numSettings, &matrix, true);
+            int newN = system.n;
+            int newM = system.m;
+            system.n = n;
+            system.m = m;
+            // worker processes and replays have fixed buffers, halos only reach into neighbouring slabs
+            bool resizable = domain.numWorkers == 1 && replayPath == NULL;
+            if (resizable && newM != m) setTypeCount(&system, newM);
+            if (resizable && newN != n) setParticleCount(&system, newN, positionMode);
+            if (domain.numWorkers == 1 || system.rMax <= 2.0f / domain.numWorkers) {
+                if (system.rMax != rMax) resizeGrid(&system);
+            } else {
+                system.rMax = rMax;
+            }
+            applyMatrix(&system, &matrix);
         }
 
+        if (simLocked) unlockSimThread(simThread);
+
         msPerFrame = stopTimer(&t0);
 
-    } while (loop);
+        if (!loop || quitRequested) break;
+    }
 
+    stopSimThread(simThread);
     if (showGui) {
-        // restore original terminal state
+        // restore original terminal state, the statistics below would be wiped off the screen
         endwin();
+        if (directOutput) stopDirectScreen(&direct);
 
         // free buffers
         delwin(win);
         delwin(infoWin);
         delwin(debugWin);
     }
-    free(densityGridBuf);
 
-    return 0;
+    if (ui.text.frames > 1) {
+        fprintf(stderr, "printed %llu frames, %.0f bytes per frame", (unsigned long long) ui.text.frames,
+                (double) ui.text.bytes / (double) ui.text.frames);
+        if (ui.printInPlace) {
+            fprintf(stderr, " (%.0f%% of redrawing every frame)", 100.0 * (double) ui.text.bytes / (double) ui.text.fullBytes);
+        }
+        fprintf(stderr, "\n");
+    }
+    stopRecording(recorder);
+    stopImageExport(exporter);
+    stopCheckpoints(&checkpointer);
+    freeRewind(&rewind);
+    if (replayPath != NULL) closeReplay(&replay);
+    // a run that could not start must not replace the saved state
+    if (savePath != NULL && exitStatus == 0) {
+        saveFile(&system, savePath);
+    }
+    if (saveSettingsPath != NULL && exitStatus == 0) {
+        saveSettings(saveSettingsPath, settings, numSettings, &system);
+    }
+    free(matrix.values);
+    if (domain.numWorkers > 1) {
+        domainStop(&domain);
+    }
+    stopThreads(system.threads);
+    arenaFree(&arena);
+
+    return exitStatus;
 }
 
 